@@ -10,16 +10,41 @@
 #include <memory>
 #include <fstream>
 #include <unordered_map>
+#include <unordered_set>
+#include <functional>
 #include <sstream>
+#include <string_view>
+#include <cstring>
 
 // Sockets
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <mutex>
+#include <thread>
+#include <future>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <filesystem>
+#include <map>
+#include <algorithm>
+#include <iomanip>
+#include <cstdlib>
+#include <dlfcn.h>
+
+// Bump when generated translations change meaning; it is part of the AOT cache key
+constexpr char VMM_VERSION[] = "1";
 
 enum class InstructionType {
     ADD,
@@ -49,15 +74,50 @@ enum class InstructionType {
 struct VMFileConfig {
     std::string vmFile;
     std::string snapshotFile;
+    int sliceInstructions = 0; // overrides the config file when set
+    bool startPaused = false;
+};
+
+// Operands live inline in the instruction: no form in the ISA takes more than three
+struct InstructionOperands {
+    static constexpr size_t MAX_OPERANDS = 3;
+    std::array<int, MAX_OPERANDS> values{};
+    uint8_t count = 0;
+
+    bool push_back(int value) {
+        if (count == MAX_OPERANDS) {
+            return false;
+        }
+        values[count++] = value;
+        return true;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    const int* data() const {
+        return values.data();
+    }
+
+    int operator[](size_t n) const {
+        return values[n];
+    }
 };
 
 struct Instruction {
     InstructionType instructionType = InstructionType::INVALID;
-    std::vector<int> operands;
-    std::string snapshotPath;
-    std::string migratePath;
+    InstructionOperands operands;
+    std::string path; // SNAPSHOT file or MIGRATE target
 };
 
+// Decoded programs are immutable once loaded and shared by every VM running them
+using SharedProgram = std::shared_ptr<const std::vector<Instruction>>;
+
 struct Config {
     int vm_exec_slice_in_instructions = 0;
     std::string vm_binary;
@@ -98,13 +158,88 @@ bool parseConfigFile(const std::string& configPath, Config& config) {
     return true;
 }
 
-bool parseSnapshotFile(const std::string& snapshotPath, std::array<int, 32>& registers, uint32_t& pc, std::string& binaryFile) {
+// Fleet manifest: one VM per line as whitespace separated key=value pairs, e.g.
+//   config=assembly_file_vm1 snapshot=snapshot_vm1 slice=4 paused=1
+bool parseFleetManifest(const std::string& manifestPath, std::vector<VMFileConfig>& vmFileConfigs) {
+    std::ifstream file(manifestPath);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open fleet manifest: " << manifestPath << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        VMFileConfig vmFileConfig;
+        std::istringstream iss(line);
+        std::string field;
+        while (iss >> field) {
+            size_t equalPos = field.find('=');
+            std::string key = field.substr(0, equalPos);
+            std::string value = equalPos == std::string::npos ? "" : field.substr(equalPos + 1);
+
+            try {
+                if (key == "config") {
+                    vmFileConfig.vmFile = value;
+                } else if (key == "snapshot") {
+                    vmFileConfig.snapshotFile = value;
+                } else if (key == "slice") {
+                    vmFileConfig.sliceInstructions = std::stoi(value);
+                } else if (key == "paused") {
+                    vmFileConfig.startPaused = value == "1";
+                } else {
+                    std::cerr << "Unknown manifest key: " << key << " (line " << lineNumber << ")" << std::endl;
+                }
+            } catch (std::exception& e) {
+                std::cerr << "Invalid value for " << key << " in fleet manifest line " << lineNumber << std::endl;
+                return false;
+            }
+        }
+
+        if (vmFileConfig.vmFile.empty()) {
+            std::cerr << "No config= in fleet manifest line " << lineNumber << std::endl;
+            return false;
+        }
+        vmFileConfigs.emplace_back(std::move(vmFileConfig));
+    }
+    return true;
+}
+
+// Reads the register lines of a snapshot store CPU chunk
+bool parseRegisterChunk(const std::string& chunkPath, std::array<int, 32>& registers) {
+    std::ifstream file(chunkPath);
+    if (!file.is_open()) {
+        std::cerr << "Missing snapshot store chunk: " << chunkPath << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.size() > 1 && line[0] == 'R') {
+            size_t equalPos = line.find('=');
+            registers[std::stoi(line.substr(1, equalPos - 1))] = std::stoi(line.substr(equalPos + 1));
+        }
+    }
+    return true;
+}
+
+// Reads a plain snapshot or a snapshot store manifest. For a manifest the registers come
+// from its CPU chunk and programImage is set to the chunk holding the program it ran.
+bool parseSnapshotFile(const std::string& snapshotPath, std::array<int, 32>& registers, uint32_t& pc, std::string& binaryFile,
+                       std::string* programImage = nullptr) {
     std::ifstream file(snapshotPath);
     if (!file.is_open()) {
         std::cerr << "Failed to open snapshot file: " << snapshotPath << std::endl;
         return false;
     }
 
+    std::string storeDir;
+    bool havePc = false;
     std::string line;
     while (std::getline(file, line)) {
         if (line.empty() || line[0] == '#') {
@@ -119,14 +254,29 @@ bool parseSnapshotFile(const std::string& snapshotPath, std::array<int, 32>& reg
             int registerIndex = std::stoi(key.substr(1));
             registers[registerIndex] = std::stoi(value);
         } else if (key == "pc") {
-            pc = static_cast<uint32_t>(std::stoi(value));
+            pc = static_cast<uint32_t>(std::stoul(value)); // 2^32-1 for a snapshot taken before the first instruction
+            havePc = true;
         } else if (key == "binary") {
             binaryFile = value;
+        } else if (key == "store") {
+            storeDir = value;
+        } else if (key == "cpu") {
+            if (!parseRegisterChunk(storeDir + "/chunks/" + value, registers)) {
+                return false;
+            }
+        } else if (key == "program") {
+            if (programImage != nullptr) {
+                *programImage = storeDir + "/chunks/" + value;
+            }
         } else {
             std::cerr << "Unknown snapshot key: " << key << std::endl;
         }
     }
     file.close();
+    if (!havePc) {
+        std::cerr << "Snapshot file has no pc: " << snapshotPath << std::endl;
+        return false;
+    }
     return true;
 }
 
@@ -184,7 +334,7 @@ Instruction parseInstruction(const std::string& line) {
     if (line.find("SNAPSHOT") != std::string::npos) {
         inst.instructionType = InstructionType::SNAPSHOT;
         auto keyLocation = line.find(' ');
-        inst.snapshotPath = line.substr(keyLocation + 1);
+        inst.path = line.substr(keyLocation + 1);
         return inst;
     }
 
@@ -192,7 +342,7 @@ Instruction parseInstruction(const std::string& line) {
         inst.instructionType = InstructionType::MIGRATE;
         std::string ipPort;
         iss >> ipPort;
-        inst.migratePath = ipPort;
+        inst.path = ipPort;
         return inst;
     }
 
@@ -200,10 +350,13 @@ Instruction parseInstruction(const std::string& line) {
 
     std::string operand;
     while(std::getline(iss, operand, ',')) {
-        if (operand.find('$') != std::string::npos) {
-            inst.operands.emplace_back(parseRegister(operand));
-        } else {
-            inst.operands.emplace_back(static_cast<int>(std::stoi(operand)));
+        bool isRegister = operand.find('$') != std::string::npos;
+        if (!inst.operands.push_back(isRegister ? parseRegister(operand) : static_cast<int>(std::stoi(operand)))) {
+            std::cerr << "Too many operands in MIPS instruction: " << line << std::endl;
+            inst.instructionType = InstructionType::INVALID;
+            return inst;
+        }
+        if (!isRegister) {
             if (inst.instructionType == InstructionType::OR) { // Convert OR to ORI internally if immediate value
                 inst.instructionType = InstructionType::ORI;
             } else if (inst.instructionType == InstructionType::XOR) {
@@ -215,6 +368,401 @@ Instruction parseInstruction(const std::string& line) {
     return inst;
 }
 
+// Runs body(i) for i in [0, count) across the available cores
+template <typename Body>
+void parallelFor(size_t count, Body body) {
+    size_t workers = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            body(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    threads.reserve(workers);
+    for (size_t w = 0; w < workers; w++) {
+        threads.emplace_back([&]() {
+            for (size_t i = next++; i < count; i = next++) {
+                body(i);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Checks that an instruction can execute without touching anything outside the
+// register file: operand count for its form, register indices and shift amounts.
+bool verifyInstruction(const Instruction& inst, std::string* reason = nullptr) {
+    const InstructionOperands& op = inst.operands;
+    auto fail = [reason](const std::string& why) {
+        if (reason != nullptr) {
+            *reason = why;
+        }
+        return false;
+    };
+    auto isRegister = [&op](size_t n) {
+        return op[n] >= 0 && op[n] < 32;
+    };
+
+    switch (inst.instructionType) {
+        case InstructionType::ADD: // rd, rs, rt
+        case InstructionType::ADDU:
+        case InstructionType::SUB:
+        case InstructionType::SUBU:
+        case InstructionType::MUL:
+        case InstructionType::AND:
+        case InstructionType::OR:
+        case InstructionType::XOR:
+            if (op.size() != 3) {
+                return fail("expected 3 register operands");
+            }
+            if (!isRegister(0) || !isRegister(1) || !isRegister(2)) {
+                return fail("register out of range");
+            }
+            return true;
+        case InstructionType::ADDI: // rt, rs, immediate
+        case InstructionType::ADDIU:
+        case InstructionType::ANDI:
+        case InstructionType::ORI:
+        case InstructionType::XORI:
+            if (op.size() != 3) {
+                return fail("expected 2 registers and an immediate");
+            }
+            if (!isRegister(0) || !isRegister(1)) {
+                return fail("register out of range");
+            }
+            return true;
+        case InstructionType::SLL: // rd, rt, shift amount
+        case InstructionType::SRL:
+            if (op.size() != 3) {
+                return fail("expected 2 registers and a shift amount");
+            }
+            if (!isRegister(0) || !isRegister(1)) {
+                return fail("register out of range");
+            }
+            if (op[2] < 0 || op[2] >= 32) {
+                return fail("shift amount out of range");
+            }
+            return true;
+        case InstructionType::MULT: // result in hi/lo, operands 1 and 2 are read
+        case InstructionType::DIV:
+            if (op.size() != 3) {
+                return fail("expected 3 register operands");
+            }
+            if (!isRegister(1) || !isRegister(2)) {
+                return fail("register out of range");
+            }
+            return true;
+        case InstructionType::LI: // rt, immediate
+            if (op.size() != 2) {
+                return fail("expected a register and an immediate");
+            }
+            if (!isRegister(0)) {
+                return fail("register out of range");
+            }
+            return true;
+        case InstructionType::DUMP_PROCESSOR_STATE:
+            return true;
+        case InstructionType::SNAPSHOT:
+            return inst.path.empty() ? fail("missing snapshot path") : true;
+        case InstructionType::MIGRATE:
+            return inst.path.empty() ? fail("missing migration target") : true;
+        default:
+            return fail("invalid instruction");
+    }
+}
+
+// Runs once per program load; on failure index and reason describe the first bad instruction
+bool verifyProgram(const std::vector<Instruction>& program, size_t& index, std::string& reason) {
+    for (index = 0; index < program.size(); index++) {
+        if (!verifyInstruction(program[index], &reason)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// opened, when given, reports whether the file could be read at all
+std::vector<Instruction> parseProgramFile(const std::string& programPath, bool* opened = nullptr) {
+    std::vector<Instruction> program;
+    std::ifstream file(programPath, std::ios::binary);
+    if (opened != nullptr) {
+        *opened = file.is_open();
+    }
+    std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    program.reserve(std::count(contents.begin(), contents.end(), '\n') + 1); // one allocation for the whole program
+
+    std::string line;
+    size_t start = 0;
+    while (start < contents.size()) {
+        size_t end = contents.find('\n', start);
+        if (end == std::string::npos) {
+            end = contents.size();
+        }
+        line.assign(contents, start, end - start);
+        if (!line.empty()) {
+            program.emplace_back(parseInstruction(line));
+        }
+        start = end + 1;
+    }
+    return program;
+}
+
+// FNV-1a 64 as hex, names files by their content (store chunks, checkpoint programs)
+std::string contentHash(std::string_view data) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    std::ostringstream oss;
+    oss << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return oss.str();
+}
+
+// tmp + rename, so readers never see a partial file (store chunks, manifests, checkpoints);
+// per-process tmp names keep VMMs writing the same path from sharing one tmp file
+bool installFile(const std::string& path, const std::string& data) {
+    std::string tmpPath = path + ".tmp" + std::to_string(getpid());
+    std::ofstream outFile(tmpPath, std::ios::binary | std::ios::trunc);
+    outFile << data;
+    outFile.close();
+    if (!outFile) {
+        std::cerr << "Couldn't write to file: " << tmpPath << std::endl;
+        std::filesystem::remove(tmpPath);
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec) {
+        std::cerr << "Couldn't install " << path << ": " << ec.message() << std::endl;
+        std::filesystem::remove(tmpPath);
+        return false;
+    }
+    return true;
+}
+
+// Compact binary program form shared by the execution log and same-host migration:
+// count, then per instruction type, operands (zigzag) and path, all as varints.
+// It is sized first and written in place, so it can go straight into a mapping.
+size_t varintSize(uint64_t value) {
+    size_t size = 1;
+    for (; value >= 0x80; value >>= 7) {
+        size++;
+    }
+    return size;
+}
+
+char* writeVarint(char* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<char>(value);
+    return out;
+}
+
+bool readVarint(std::string_view data, size_t& pos, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < data.size(); shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(data[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t zigzag(int value) {
+    return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+size_t encodedProgramSize(const std::vector<Instruction>& program) {
+    size_t size = varintSize(program.size());
+    for (const auto& inst : program) {
+        size += varintSize(static_cast<uint64_t>(inst.instructionType)) + varintSize(inst.operands.size());
+        for (size_t n = 0; n < inst.operands.size(); n++) {
+            size += varintSize(zigzag(inst.operands[n]));
+        }
+        size += varintSize(inst.path.size()) + inst.path.size();
+    }
+    return size;
+}
+
+// writes encodedProgramSize(program) bytes at out and returns the end
+char* encodeProgram(const std::vector<Instruction>& program, char* out) {
+    out = writeVarint(out, program.size());
+    for (const auto& inst : program) {
+        out = writeVarint(out, static_cast<uint64_t>(inst.instructionType));
+        out = writeVarint(out, inst.operands.size());
+        for (size_t n = 0; n < inst.operands.size(); n++) {
+            out = writeVarint(out, zigzag(inst.operands[n]));
+        }
+        out = writeVarint(out, inst.path.size());
+        out = std::copy(inst.path.begin(), inst.path.end(), out);
+    }
+    return out;
+}
+
+bool decodeProgram(std::string_view data, size_t& pos, std::vector<Instruction>& program) {
+    uint64_t count = 0;
+    if (!readVarint(data, pos, count) || count > data.size() - pos) { // every instruction takes bytes
+        return false;
+    }
+    program.reserve(count);
+    for (uint64_t n = 0; n < count; n++) {
+        Instruction inst;
+        uint64_t type = 0;
+        uint64_t operandCount = 0;
+        if (!readVarint(data, pos, type) || type > static_cast<uint64_t>(InstructionType::INVALID) ||
+            !readVarint(data, pos, operandCount) || operandCount > InstructionOperands::MAX_OPERANDS) {
+            return false;
+        }
+        inst.instructionType = static_cast<InstructionType>(type);
+        for (uint64_t k = 0; k < operandCount; k++) {
+            uint64_t value = 0;
+            if (!readVarint(data, pos, value)) {
+                return false;
+            }
+            uint32_t encoded = static_cast<uint32_t>(value);
+            inst.operands.push_back(static_cast<int>((encoded >> 1) ^ (0u - (encoded & 1))));
+        }
+        uint64_t pathSize = 0;
+        if (!readVarint(data, pos, pathSize) || pathSize > data.size() - pos) {
+            return false;
+        }
+        inst.path.assign(data.substr(pos, pathSize));
+        pos += pathSize;
+        program.push_back(std::move(inst));
+    }
+    return true;
+}
+
+// Parses each vm_binary once and hands every VM the same copy, both when many VMs start
+// from the same program in parallel and when hibernated VMs wake. Finished parses are held
+// weakly, so a program is freed once no resident VM uses it and parsed again if needed.
+class ProgramCache {
+public:
+    // an empty program if the file can't be opened, as when a VM parses it itself
+    SharedProgram get(const std::string& programPath) {
+        SharedProgram program = load(programPath);
+        return program ? program : std::make_shared<const std::vector<Instruction>>();
+    }
+
+    // null if the file can't be opened
+    SharedProgram load(const std::string& programPath) {
+        return get(programPath, [&programPath](std::vector<Instruction>& program) {
+            bool opened;
+            program = parseProgramFile(programPath, &opened);
+            return opened;
+        });
+    }
+
+    // same, for programs stored in another format (snapshot store images). Null when parse fails.
+    SharedProgram get(const std::string& programPath, const std::function<bool(std::vector<Instruction>&)>& parse) {
+        std::shared_future<SharedProgram> program;
+        std::promise<SharedProgram> parsed;
+        bool parseHere = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Entry& entry = programs[programPath];
+            if (SharedProgram resident = entry.resident.lock()) {
+                return resident;
+            }
+            if (!entry.parsing.valid()) {
+                entry.parsing = parsed.get_future().share();
+                parseHere = true;
+            }
+            program = entry.parsing;
+        }
+
+        if (parseHere) {
+            std::vector<Instruction> instructions;
+            SharedProgram result = parse(instructions) ? std::make_shared<const std::vector<Instruction>>(std::move(instructions)) : nullptr;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                Entry& entry = programs[programPath];
+                entry.resident = result;
+                entry.parsing = std::shared_future<SharedProgram>();
+            }
+            parsed.set_value(result);
+        }
+        return program.get();
+    }
+
+private:
+    struct Entry {
+        std::shared_future<SharedProgram> parsing; // valid while one thread parses it for the others
+        std::weak_ptr<const std::vector<Instruction>> resident;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> programs;
+};
+
+// Slab allocator for objects a fleet creates by the thousand (VMs, CPUs). Slots are
+// carved out of SLOTS_PER_SLAB-sized slabs and recycled through a free list, so VM
+// churn reuses the same memory instead of fragmenting the heap. Slabs live until exit.
+template <typename T>
+class SlabPool {
+public:
+    static void* allocate(size_t size) {
+        if (size != sizeof(T)) { // derived type, not ours
+            return ::operator new(size);
+        }
+        SlabPool& pool = instance();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.freeList == nullptr) {
+            pool.grow();
+        }
+        Slot* slot = pool.freeList;
+        pool.freeList = slot->next;
+        return slot;
+    }
+
+    static void release(void* p, size_t size) {
+        if (size != sizeof(T)) {
+            ::operator delete(p);
+            return;
+        }
+        SlabPool& pool = instance();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        Slot* slot = static_cast<Slot*>(p);
+        slot->next = pool.freeList;
+        pool.freeList = slot;
+    }
+
+private:
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+    static constexpr size_t SLOTS_PER_SLAB = 256;
+
+    static SlabPool& instance() {
+        static SlabPool pool;
+        return pool;
+    }
+
+    void grow() {
+        slabs.emplace_back(std::make_unique<Slot[]>(SLOTS_PER_SLAB));
+        Slot* slab = slabs.back().get();
+        for (size_t n = SLOTS_PER_SLAB; n-- > 0;) {
+            slab[n].next = freeList;
+            freeList = &slab[n];
+        }
+    }
+
+    std::mutex mutex;
+    Slot* freeList = nullptr;
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+};
+
 class CPU {
 public:
     int VMID = 0;
@@ -223,13 +771,20 @@ public:
     uint32_t lo; // mult special register
     uint32_t pc;
 
-    CPU(int vmID) : pc(0), VMID(vmID) {
+    CPU(int vmID) : hi(0), lo(0), pc(0), VMID(vmID) {
         registers.fill(0);
     }
-    CPU(const std::array<int, 32> regs, int vmID) : pc(0), VMID(vmID) {
+    CPU(const std::array<int, 32> regs, int vmID) : hi(0), lo(0), pc(0), VMID(vmID) {
         registers = regs;
     }
+    // Checked path for programs that didn't pass verifyProgram
     void execute(const Instruction& inst) {
+        if (inst.instructionType != InstructionType::INVALID && !verifyInstruction(inst)) {
+            std::cerr << "Skipping MIPS instruction with invalid operands" << std::endl;
+            pc++;
+            return;
+        }
+
         switch(inst.instructionType) {
             // ARITHMETIC
             case InstructionType::ADD:
@@ -365,9 +920,9 @@ public:
                     registers[regNum] = std::stoi(value);
                 }
             } else if (key == "lo") {
-                lo = static_cast<uint32_t>(std::stoi(value));
+                lo = static_cast<uint32_t>(std::stoul(value));
             } else if (key == "hi") {
-                hi = static_cast<uint32_t>(std::stoi(value));
+                hi = static_cast<uint32_t>(std::stoul(value));
             } else {
                 std::cout << "Couldn't deserialize key: " << key << std::endl;
             }
@@ -389,382 +944,3256 @@ public:
         std::cout << "\n";
     }
 
+    static void* operator new(size_t size);
+    static void operator delete(void* p, size_t size);
 };
 
-class VM {
-private:
-    Config config;
-    std::unique_ptr<CPU> cpu;
-    std::vector<Instruction> instructions;
-    int currentInstructionIndex;
-    bool migrated = false;
+void* CPU::operator new(size_t size) {
+    return SlabPool<CPU>::allocate(size);
+}
+
+void CPU::operator delete(void* p, size_t size) {
+    SlabPool<CPU>::release(p, size);
+}
 
+// Record/replay log. Only the nondeterministic inputs of a run are kept: the state
+// of every VM as it joins the hypervisor, the slice the scheduler gave each VM,
+// guest SNAPSHOT/MIGRATE points and migrations requested over the control socket.
+// Records are a type byte followed by varints, buffered and written in blocks.
+class ExecutionLog {
 public:
-    VM(Config c) : config(std::move(c)), cpu(std::make_unique<CPU>(config.vmID)), currentInstructionIndex(0) {
-        loadInstructions();
-    }
+    enum RecordType : uint8_t {
+        RESTORE = 1,       // vm, state
+        SLICE = 2,         // vm, instructions executed
+        GUEST_EVENT = 3,   // vm, instruction type, instruction index
+        MIGRATED = 4,      // vm
+        PROGRAM = 5,       // program id, encoded instructions; consumed by next()
+        RESTORE_SHARED = 6 // vm, program id, state without its program
+    };
 
-    VM(Config c, std::unique_ptr<CPU> snapshotCPU) : cpu(std::move(snapshotCPU)), config(std::move(c)), currentInstructionIndex(0) {
-        loadInstructions();
-    }
+    struct Record {
+        RecordType type;
+        uint64_t vm = 0;
+        uint64_t value = 0;
+        uint64_t extra = 0;
+        std::string state;
+        SharedProgram program; // RESTORE_SHARED only
+    };
 
-    VM(Config c, std::unique_ptr<CPU> snapshotCPU, int current_instruction_index) : cpu(std::move(snapshotCPU)),
-            config(std::move(c)), currentInstructionIndex(current_instruction_index) {
-        loadInstructions();
+    struct GuestEvent {
+        uint64_t vm;
+        uint64_t type;
+        uint64_t instructionIndex;
+        bool operator==(const GuestEvent&) const = default;
+    };
+
+    ~ExecutionLog() {
+        flush();
     }
 
-    void loadInstructions() {
-        std::ifstream file(config.vm_binary);
-        std::string line;
-        while (std::getline(file, line)) {
-            if (!line.empty()) {
-                instructions.emplace_back(parseInstruction(line));
-            }
+    bool openForRecord(const std::string& path) {
+        file.open(path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cerr << "Couldn't write to file: " << path << std::endl;
+            return false;
         }
+        file.write(MAGIC, sizeof(MAGIC) - 1);
+        recording = true;
+        return true;
     }
 
-    const std::vector<Instruction> getInstructions() const {
-        return instructions;
+    bool openForReplay(const std::string& path) {
+        std::ifstream inFile(path, std::ios::binary);
+        if (!inFile.is_open()) {
+            std::cerr << "Failed to open replay log: " << path << std::endl;
+            return false;
+        }
+        std::stringstream contents;
+        contents << inFile.rdbuf();
+        buffer = contents.str();
+        if (buffer.compare(0, sizeof(MAGIC) - 1, MAGIC) != 0) {
+            std::cerr << "Not a VMM replay log: " << path << std::endl;
+            return false;
+        }
+        readPos = sizeof(MAGIC) - 1;
+        replaying = true;
+        return true;
     }
 
-    void changeVMID(int vmID) {
-        cpu->changeVMID(vmID);
+    bool isRecording() const {
+        return recording;
     }
 
-    void snapshot(const std::string& outputPath) {
-        std::cout << "Creating snapshot: " << outputPath << ", pc: " << cpu->pc << std::endl;
-        std::ofstream outFile(outputPath);
+    bool isReplaying() const {
+        return replaying;
+    }
 
-        if (!outFile.is_open()) {
-            std::cerr << "Couldn't write to file: " << outputPath << std::endl;
+    // state carries no program; the program is logged once per distinct content, so a
+    // fleet sharing one costs a single PROGRAM record
+    void restore(uint64_t vm, const std::string& state, const SharedProgram& program) {
+        if (!recording) {
             return;
         }
-
-        for (int i = 0; i < cpu->registers.size(); i++) {
-            outFile << "R" << i << "=" << cpu->registers.at(i) << "\n";
+        if (!program) { // released, nothing left to run
+            buffer.push_back(RESTORE);
+            putVarint(vm);
+        } else {
+            uint64_t programId = logProgram(program);
+            buffer.push_back(RESTORE_SHARED);
+            putVarint(vm);
+            putVarint(programId);
         }
-
-        outFile << "pc=" << cpu->pc << "\n";
-        outFile << "binary=" << config.vm_binary << "\n";
-
-        outFile.close();
-        cpu->pc++;
+        putVarint(state.size());
+        buffer.append(state);
+        flushIfFull();
     }
 
-    std::string serialize() const {
-        std::ostringstream oss;
-        oss << "curr_inst_index=" << currentInstructionIndex + 1 << "\n";
-        oss << "slice_instructions=" << config.vm_exec_slice_in_instructions << "\n";
+    void slice(uint64_t vm, uint64_t executed) {
+        buffer.push_back(SLICE);
+        putVarint(vm);
+        putVarint(executed);
+        flushIfFull();
+    }
 
-        // serialize instructions
-        for (int i = 0; i < instructions.size(); i++) {
-            oss << "instruction=";
-            oss << instToString(instructions[i]) << "\n";
+    void guestEvent(uint64_t vm, InstructionType type, uint64_t instructionIndex) {
+        GuestEvent event{vm, static_cast<uint64_t>(type), instructionIndex};
+        if (replaying) { // checked against the recorded events by the replayer
+            observedEvents.push_back(event);
+            return;
         }
+        buffer.push_back(GUEST_EVENT);
+        putVarint(event.vm);
+        putVarint(event.type);
+        putVarint(event.instructionIndex);
+        flushIfFull();
+    }
 
-        oss << cpu->serialize();
-
-        return oss.str();
+    void migrated(uint64_t vm) {
+        buffer.push_back(MIGRATED);
+        putVarint(vm);
+        flushIfFull();
     }
 
-    std::string instToString(const Instruction& inst) const {
-        std::ostringstream oss;
+    void flush() {
+        if (recording && !buffer.empty()) {
+            file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            file.flush();
+            buffer.clear();
+        }
+    }
 
-        // serialize inst type
-        switch(inst.instructionType) {
-            // ARITHMETIC
-            case InstructionType::ADD:
-                oss << "add";
+    // Replay side: false at the end of the log or on a truncated record
+    bool next(Record& record) {
+        if (readPos >= buffer.size()) {
+            return false;
+        }
+        record.type = static_cast<RecordType>(static_cast<uint8_t>(buffer[readPos++]));
+        bool ok = getVarint(record.vm);
+        switch (record.type) {
+            case PROGRAM: {
+                uint64_t size = 0;
+                ok = ok && getVarint(size) && readPos + size <= buffer.size();
+                std::vector<Instruction> program;
+                size_t end = readPos + size;
+                ok = ok && decodeProgram(std::string_view(buffer).substr(0, end), readPos, program) && readPos == end;
+                if (!ok) {
+                    break;
+                }
+                replayPrograms[record.vm] = std::make_shared<const std::vector<Instruction>>(std::move(program));
+                return next(record);
+            }
+            case RESTORE:
+            case RESTORE_SHARED: {
+                if (record.type == RESTORE_SHARED) {
+                    ok = ok && getVarint(record.value);
+                    auto program = replayPrograms.find(record.value);
+                    if (ok && program == replayPrograms.end()) {
+                        std::cerr << "Replay log restores VM " << record.vm << " with unknown program " << record.value << std::endl;
+                        return false;
+                    }
+                    record.program = ok ? program->second : nullptr;
+                }
+                uint64_t size = 0;
+                ok = ok && getVarint(size) && readPos + size <= buffer.size();
+                if (ok) {
+                    record.state.assign(buffer, readPos, size);
+                    readPos += size;
+                }
                 break;
-            case InstructionType::SUB:
-                oss << "sub";
+            }
+            case SLICE:
+                ok = ok && getVarint(record.value);
                 break;
-            case InstructionType::ADDI:
-                oss << "addi";
+            case GUEST_EVENT:
+                ok = ok && getVarint(record.value) && getVarint(record.extra);
                 break;
-            case InstructionType::ADDU: {
-                oss << "addu";
+            case MIGRATED:
                 break;
-            }
-            case InstructionType::SUBU: {
-                oss << "subu";
+            default:
+                std::cerr << "Unknown replay record type " << static_cast<int>(record.type) << std::endl;
+                return false;
+        }
+        if (!ok) {
+            std::cerr << "Truncated replay log" << std::endl;
+        }
+        return ok;
+    }
+
+    std::vector<GuestEvent> takeObservedEvents() {
+        std::vector<GuestEvent> events;
+        events.swap(observedEvents);
+        return events;
+    }
+
+private:
+    static constexpr char MAGIC[] = "VMMLOG1\n";
+    static constexpr size_t FLUSH_THRESHOLD = 64 * 1024;
+
+    std::ofstream file;
+    std::string buffer; // pending records when recording, whole log when replaying
+    size_t readPos = 0;
+    bool recording = false;
+    bool replaying = false;
+    std::vector<GuestEvent> observedEvents;
+
+    // Programs logged so far. By address first, so VMs sharing a program don't re-encode
+    // it, then by content hash; weak, so logging never keeps a released program alive.
+    struct LoggedProgram {
+        std::weak_ptr<const std::vector<Instruction>> program;
+        uint64_t id;
+    };
+    std::unordered_map<const std::vector<Instruction>*, LoggedProgram> loggedByAddress;
+    std::unordered_map<std::string, LoggedProgram> loggedByHash;
+    uint64_t nextProgramId = 0;
+    std::unordered_map<uint64_t, SharedProgram> replayPrograms;
+
+    uint64_t logProgram(const SharedProgram& program) {
+        auto known = loggedByAddress.find(program.get());
+        if (known != loggedByAddress.end() && known->second.program.lock() == program) {
+            return known->second.id;
+        }
+
+        std::string encoded(encodedProgramSize(*program), '\0');
+        encodeProgram(*program, encoded.data());
+        std::string hash = contentHash(encoded);
+        auto same = loggedByHash.find(hash);
+        SharedProgram logged = same != loggedByHash.end() ? same->second.program.lock() : nullptr;
+        uint64_t id;
+        if (logged && sameProgram(*logged, *program)) { // FNV only finds the candidate
+            id = same->second.id;
+        } else {
+            id = nextProgramId++;
+            buffer.push_back(PROGRAM);
+            putVarint(id);
+            putVarint(encoded.size());
+            buffer.append(encoded);
+            loggedByHash[hash] = {program, id};
+        }
+        loggedByAddress[program.get()] = {program, id};
+        return id;
+    }
+
+    static bool sameProgram(const std::vector<Instruction>& a, const std::vector<Instruction>& b) {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const Instruction& x, const Instruction& y) {
+            return x.instructionType == y.instructionType && x.operands.size() == y.operands.size() &&
+                   std::equal(x.operands.data(), x.operands.data() + x.operands.size(), y.operands.data()) &&
+                   x.path == y.path;
+        });
+    }
+
+    static void appendVarint(std::string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    void putVarint(uint64_t value) {
+        appendVarint(buffer, value);
+    }
+
+    bool getVarint(uint64_t& value) {
+        return readVarint(buffer, readPos, value);
+    }
+
+    void flushIfFull() {
+        if (buffer.size() >= FLUSH_THRESHOLD) {
+            flush();
+        }
+    }
+};
+
+// Guest sampling profiler. VMs report the instruction index of every Nth executed
+// instruction into a single-producer ring (the scheduler thread); a collector
+// thread drains it into per-VM histograms that are reported at exit or on demand.
+class Profiler {
+public:
+    struct Sample {
+        uint32_t slot;
+        uint32_t instructionIndex;
+    };
+
+    explicit Profiler(uint64_t interval) : sampleInterval(interval) {}
+
+    ~Profiler() {
+        stop();
+    }
+
+    void start() {
+        collecting = true;
+        collector = std::thread([this]() {
+            while (collecting.load(std::memory_order_relaxed)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                drain();
+            }
+        });
+    }
+
+    void stop() {
+        if (collecting.exchange(false)) {
+            collector.join();
+        }
+        drain();
+    }
+
+    void registerVM(uint32_t slot, int vmID, const std::string& binary) {
+        std::lock_guard<std::mutex> lock(histogramMutex);
+        if (slot >= vmInfo.size()) {
+            vmInfo.resize(slot + 1);
+        }
+        vmInfo[slot] = VMInfo{vmID, binary, {}};
+    }
+
+    // Called once per slice: there are no branches, so the slice covered instructions
+    // startIndex.. in order and the samples are the ones where the per-VM executed
+    // count crosses a multiple of the interval.
+    void sampleSlice(uint32_t slot, int startIndex, uint64_t executedBefore, int count) {
+        uint64_t next = (executedBefore / sampleInterval + 1) * sampleInterval;
+        for (; next <= executedBefore + count; next += sampleInterval) {
+            push(Sample{slot, static_cast<uint32_t>(startIndex + (next - executedBefore - 1))});
+        }
+    }
+
+    // Hot instructions and ranges per VM, mapped to vm_binary lines
+    std::string report() {
+        drain();
+        std::lock_guard<std::mutex> lock(histogramMutex);
+        std::ostringstream oss;
+        oss << "==== Profile (1 sample / " << sampleInterval << " instructions, "
+            << dropped.load(std::memory_order_relaxed) << " dropped) ====\n";
+        for (auto& info : vmInfo) {
+            if (info.samples.empty()) {
+                continue;
+            }
+            uint64_t total = 0;
+            std::map<uint32_t, uint64_t> ranges;
+            std::vector<std::pair<uint32_t, uint64_t>> hot(info.samples.begin(), info.samples.end());
+            for (const auto& [index, count] : hot) {
+                total += count;
+                ranges[index / RANGE_SIZE] += count;
+            }
+            std::sort(hot.begin(), hot.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+            const auto& source = sourceLines(info.binary);
+            oss << "VM " << info.vmID << " (" << (info.binary.empty() ? "migrated" : info.binary) << "): "
+                << total << " samples\n";
+            oss << "  hot instructions:\n";
+            for (size_t n = 0; n < hot.size() && n < TOP_ENTRIES; n++) {
+                oss << "    " << std::setw(6) << std::fixed << std::setprecision(1) << 100.0 * hot[n].second / total
+                    << "%  " << describe(source, hot[n].first) << "\n";
+            }
+
+            std::vector<std::pair<uint32_t, uint64_t>> hotRanges(ranges.begin(), ranges.end());
+            std::sort(hotRanges.begin(), hotRanges.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+            oss << "  hot ranges:\n";
+            for (size_t n = 0; n < hotRanges.size() && n < TOP_ENTRIES; n++) {
+                oss << "    " << std::setw(6) << std::fixed << std::setprecision(1) << 100.0 * hotRanges[n].second / total
+                    << "%  " << rangeName(source, hotRanges[n].first) << "\n";
+            }
+        }
+        return oss.str();
+    }
+
+    // Folded stacks (vm;binary;range;line count) for flamegraph.pl and compatible tools
+    bool writeFolded(const std::string& path) {
+        drain();
+        std::lock_guard<std::mutex> lock(histogramMutex);
+        std::ofstream outFile(path, std::ios::trunc);
+        if (!outFile.is_open()) {
+            std::cerr << "Couldn't write to file: " << path << std::endl;
+            return false;
+        }
+        for (auto& info : vmInfo) {
+            const auto& source = sourceLines(info.binary);
+            for (const auto& [index, count] : info.samples) {
+                outFile << "vm_" << info.vmID << ";" << (info.binary.empty() ? "migrated" : info.binary) << ";"
+                        << rangeName(source, index / RANGE_SIZE) << ";" << describe(source, index) << " " << count << "\n";
+            }
+        }
+        outFile.close();
+        return static_cast<bool>(outFile);
+    }
+
+private:
+    static constexpr size_t RING_SIZE = 1 << 16; // power of two
+    static constexpr uint32_t RANGE_SIZE = 16;   // instructions per hot range
+    static constexpr size_t TOP_ENTRIES = 10;
+
+    struct SourceLine {
+        int lineNumber;
+        std::string text;
+    };
+
+    struct VMInfo {
+        int vmID = 0;
+        std::string binary;
+        std::map<uint32_t, uint64_t> samples; // instruction index -> count
+    };
+
+    uint64_t sampleInterval;
+    std::array<Sample, RING_SIZE> ring;
+    std::atomic<size_t> head{0}; // written by the producer
+    std::atomic<size_t> tail{0}; // written by the consumer
+    std::atomic<uint64_t> dropped{0};
+
+    std::thread collector;
+    std::atomic<bool> collecting{false};
+
+    std::mutex histogramMutex; // serializes consumers and guards the histograms
+    std::vector<VMInfo> vmInfo;
+    std::unordered_map<std::string, std::vector<SourceLine>> sourceCache;
+
+    void push(const Sample& sample) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == RING_SIZE) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        ring[h & (RING_SIZE - 1)] = sample;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    void drain() {
+        std::lock_guard<std::mutex> lock(histogramMutex);
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        for (; t != h; t++) {
+            const Sample& sample = ring[t & (RING_SIZE - 1)];
+            if (sample.slot >= vmInfo.size()) {
+                vmInfo.resize(sample.slot + 1);
+            }
+            vmInfo[sample.slot].samples[sample.instructionIndex]++;
+        }
+        tail.store(t, std::memory_order_release);
+    }
+
+    // Instruction index -> line of the vm_binary, skipping blank lines like loadInstructions
+    const std::vector<SourceLine>& sourceLines(const std::string& binary) {
+        auto it = sourceCache.find(binary);
+        if (it != sourceCache.end()) {
+            return it->second;
+        }
+        std::vector<SourceLine> lines;
+        std::ifstream file(binary);
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(file, line)) {
+            lineNumber++;
+            if (!line.empty()) {
+                lines.push_back(SourceLine{lineNumber, line});
+            }
+        }
+        return sourceCache.emplace(binary, std::move(lines)).first->second;
+    }
+
+    static std::string describe(const std::vector<SourceLine>& source, uint32_t index) {
+        if (index < source.size()) {
+            return "line " + std::to_string(source[index].lineNumber) + ": " + source[index].text;
+        }
+        return "inst " + std::to_string(index);
+    }
+
+    static std::string rangeName(const std::vector<SourceLine>& source, uint32_t range) {
+        uint32_t first = range * RANGE_SIZE;
+        uint32_t last = first + RANGE_SIZE - 1;
+        if (first < source.size()) {
+            return "lines " + std::to_string(source[first].lineNumber) + "-" +
+                   std::to_string(source[std::min<size_t>(last, source.size() - 1)].lineNumber);
+        }
+        return "insts " + std::to_string(first) + "-" + std::to_string(last);
+    }
+};
+
+// Entry point of an ahead-of-time translated program. Runs at most count instructions
+// from start and returns how many ran; it stops early at anything it leaves to the
+// interpreter (SNAPSHOT, MIGRATE, DUMP_PROCESSOR_STATE, division by zero, bad operands).
+using TranslatedProgram = int (*)(int* registers, uint32_t* hi, uint32_t* lo, int start, int count);
+
+// A translation that may still be compiling. entry is written before ready is set, and
+// stays null if the program couldn't be translated.
+struct PendingTranslation {
+    std::atomic<bool> ready{false};
+    TranslatedProgram entry = nullptr;
+};
+
+// Handlers for verified programs, one per InstructionType, specialized at compile time.
+// Operand count and register indices were proven by verifyProgram, so nothing is checked here.
+template <InstructionType T>
+void executeVerified(CPU& cpu, const Instruction& inst) {
+    auto& r = cpu.registers;
+    const int* op = inst.operands.data();
+
+    if constexpr (T == InstructionType::ADD || T == InstructionType::ADDU) {
+        r[op[0]] = static_cast<int>(static_cast<uint32_t>(r[op[1]]) + static_cast<uint32_t>(r[op[2]]));
+    } else if constexpr (T == InstructionType::SUB || T == InstructionType::SUBU) {
+        r[op[0]] = static_cast<int>(static_cast<uint32_t>(r[op[1]]) - static_cast<uint32_t>(r[op[2]]));
+    } else if constexpr (T == InstructionType::ADDI || T == InstructionType::ADDIU) {
+        r[op[0]] = static_cast<int>(static_cast<uint32_t>(r[op[1]]) + static_cast<uint32_t>(op[2]));
+    } else if constexpr (T == InstructionType::MUL) {
+        r[op[0]] = r[op[1]] * r[op[2]];
+    } else if constexpr (T == InstructionType::MULT) {
+        int64_t res = r[op[1]] * r[op[2]];
+        cpu.hi = static_cast<int32_t>((res >> 32));
+        cpu.lo = static_cast<int32_t>(res);
+    } else if constexpr (T == InstructionType::DIV) {
+        if (r[op[2]] == 0) {
+            std::cerr << "Divide by 0 error" << std::endl;
+        } else {
+            cpu.lo = r[op[1]] / r[op[2]];
+            cpu.hi = r[op[1]] % r[op[2]];
+        }
+    } else if constexpr (T == InstructionType::AND) {
+        r[op[0]] = r[op[1]] & r[op[2]];
+    } else if constexpr (T == InstructionType::ANDI) {
+        r[op[0]] = r[op[1]] & op[2];
+    } else if constexpr (T == InstructionType::OR) {
+        r[op[0]] = r[op[1]] | r[op[2]];
+    } else if constexpr (T == InstructionType::ORI) {
+        r[op[0]] = r[op[1]] | op[2];
+    } else if constexpr (T == InstructionType::XOR) {
+        r[op[0]] = r[op[1]] ^ r[op[2]];
+    } else if constexpr (T == InstructionType::XORI) {
+        r[op[0]] = r[op[1]] ^ op[2];
+    } else if constexpr (T == InstructionType::SLL) {
+        r[op[0]] = r[op[1]] << op[2];
+    } else if constexpr (T == InstructionType::SRL) {
+        r[op[0]] = r[op[1]] >> op[2];
+    } else if constexpr (T == InstructionType::LI) {
+        r[op[0]] = op[1];
+    } else if constexpr (T == InstructionType::DUMP_PROCESSOR_STATE) {
+        cpu.dumpState();
+    }
+    // SNAPSHOT and MIGRATE are handled by the VM, INVALID never passes verification
+    cpu.pc++;
+}
+
+using VerifiedHandler = void (*)(CPU&, const Instruction&);
+
+template <size_t... Types>
+constexpr std::array<VerifiedHandler, sizeof...(Types)> makeVerifiedHandlers(std::index_sequence<Types...>) {
+    return {&executeVerified<static_cast<InstructionType>(Types)>...};
+}
+
+constexpr auto verifiedHandlers =
+        makeVerifiedHandlers(std::make_index_sequence<static_cast<size_t>(InstructionType::INVALID) + 1>());
+
+// Content-addressed snapshot store. With a store, a snapshot file is a small manifest
+// naming its chunks (CPU state, program image) by content hash. Each chunk is kept once
+// in dir/chunks and shared by every snapshot containing it, so a fleet running the same
+// program stores that program once. dir/refs/<hash> counts the manifests using a chunk;
+// the chunk is deleted when the count drops to zero. Used from the scheduler thread only;
+// VMMs sharing a store serialize their updates with flock on dir/lock.
+class SnapshotStore {
+public:
+    // manifests name the store, so keep it absolute for restores from another directory
+    explicit SnapshotStore(const std::string& dir) : storeDir(std::filesystem::absolute(dir).lexically_normal().string()) {}
+
+    ~SnapshotStore() {
+        if (lockFd >= 0) {
+            close(lockFd);
+        }
+    }
+
+    bool open() {
+        std::error_code ec;
+        std::filesystem::create_directories(storeDir + "/chunks", ec);
+        if (!ec) {
+            std::filesystem::create_directories(storeDir + "/refs", ec);
+        }
+        if (ec) {
+            std::cerr << "Couldn't create snapshot store " << storeDir << ": " << ec.message() << std::endl;
+            return false;
+        }
+        lockFd = ::open((storeDir + "/lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lockFd < 0) {
+            perror("open");
+            return false;
+        }
+        return true;
+    }
+
+    // Writes the manifest at path. makeImage is only called the first time a program is seen.
+    bool write(const std::string& path, const std::string& cpuState, uint32_t pc, const std::string& binary,
+               const SharedProgram& program, const std::function<std::string()>& makeImage) {
+        StoreLock lock(lockFd);
+        std::string cpuHash;
+        std::string programHash;
+        if (!putChunk(cpuState, cpuHash) || !putProgram(program, makeImage, programHash)) {
+            return false;
+        }
+
+        std::vector<std::string> previous = manifestChunks(path); // overwriting a snapshot releases its chunks
+
+        std::ostringstream manifest;
+        manifest << "store=" << storeDir << "\n"
+                 << "cpu=" << cpuHash << "\n"
+                 << "program=" << programHash << "\n"
+                 << "pc=" << pc << "\n"
+                 << "binary=" << binary << "\n";
+        addRef(cpuHash);
+        addRef(programHash);
+        if (!installFile(path, manifest.str())) {
+            dropRef(cpuHash);
+            dropRef(programHash);
+            return false;
+        }
+        for (const auto& hash : previous) {
+            dropRef(hash);
+        }
+        return true;
+    }
+
+    // Deletes a snapshot written to this store and releases its chunks
+    bool remove(const std::string& path) {
+        StoreLock lock(lockFd);
+        std::vector<std::string> chunks = manifestChunks(path);
+        if (chunks.empty()) {
+            std::cerr << path << " isn't a snapshot in store " << storeDir << std::endl;
+            return false;
+        }
+        std::filesystem::remove(path);
+        for (const auto& hash : chunks) {
+            dropRef(hash);
+        }
+        return true;
+    }
+
+private:
+    std::string storeDir;
+    int lockFd = -1;
+
+    // Held across a whole update, so ref counts and chunk deletion never race another VMM
+    struct StoreLock {
+        int fd;
+        explicit StoreLock(int fd) : fd(fd) {
+            while (flock(fd, LOCK_EX) < 0 && errno == EINTR) {
+            }
+        }
+        ~StoreLock() {
+            flock(fd, LOCK_UN);
+        }
+    };
+
+    // hash of each live program's image, so it is serialized once and not per snapshot.
+    // The program is immutable, so its image only needs comparing the first time.
+    struct ProgramImage {
+        std::weak_ptr<const std::vector<Instruction>> program;
+        std::string hash;
+    };
+    std::unordered_map<const std::vector<Instruction>*, ProgramImage> programImages;
+
+    std::string chunkPath(const std::string& hash) const {
+        return storeDir + "/chunks/" + hash;
+    }
+
+    std::string refPath(const std::string& hash) const {
+        return storeDir + "/refs/" + hash;
+    }
+
+    // FNV-1a only finds the candidate, so an existing chunk is always compared before
+    // it's shared; CPU chunks are guest-controlled and could be crafted to collide
+    bool putChunk(const std::string& data, std::string& hash) {
+        hash = contentHash(data);
+        std::ifstream existing(chunkPath(hash), std::ios::binary);
+        if (existing.is_open()) {
+            std::string contents((std::istreambuf_iterator<char>(existing)), std::istreambuf_iterator<char>());
+            if (contents != data) {
+                std::cerr << "Snapshot store hash collision on chunk " << hash << std::endl;
+                return false;
+            }
+        } else if (!installFile(chunkPath(hash), data)) {
+            return false;
+        }
+        return true;
+    }
+
+    bool putProgram(const SharedProgram& program, const std::function<std::string()>& makeImage, std::string& hash) {
+        auto it = programImages.find(program.get());
+        if (it != programImages.end() && it->second.program.lock() == program &&
+            std::filesystem::exists(chunkPath(it->second.hash))) {
+            hash = it->second.hash;
+            return true;
+        }
+        if (!putChunk(makeImage(), hash)) {
+            return false;
+        }
+        if (program) {
+            programImages[program.get()] = {program, hash};
+        }
+        return true;
+    }
+
+    uint64_t readRefs(const std::string& hash) const {
+        std::ifstream file(refPath(hash));
+        uint64_t refs = 0;
+        file >> refs;
+        return refs;
+    }
+
+    void addRef(const std::string& hash) {
+        installFile(refPath(hash), std::to_string(readRefs(hash) + 1) + "\n");
+    }
+
+    void dropRef(const std::string& hash) {
+        uint64_t refs = readRefs(hash);
+        if (refs > 1) {
+            installFile(refPath(hash), std::to_string(refs - 1) + "\n");
+            return;
+        }
+        std::filesystem::remove(chunkPath(hash));
+        std::filesystem::remove(refPath(hash));
+    }
+
+    // Chunk hashes of the manifest at path, empty unless it belongs to this store
+    std::vector<std::string> manifestChunks(const std::string& path) const {
+        std::vector<std::string> chunks;
+        std::ifstream file(path);
+        std::string line;
+        bool ours = false;
+        while (std::getline(file, line)) {
+            size_t equalPos = line.find('=');
+            if (equalPos == std::string::npos) {
+                continue;
+            }
+            std::string key = line.substr(0, equalPos);
+            std::string value = line.substr(equalPos + 1);
+            if (key == "store") {
+                ours = value == storeDir;
+            } else if (key == "cpu" || key == "program") {
+                chunks.push_back(value);
+            }
+        }
+        return ours ? chunks : std::vector<std::string>();
+    }
+};
+
+class VM {
+private:
+    Config config;
+    std::unique_ptr<CPU> cpu;
+    SharedProgram instructions; // null while hibernated or once released
+    int currentInstructionIndex;
+    bool migrated = false;
+    bool paused = false; // set through the control socket
+
+    // per-VM stats reported over the control socket
+    uint64_t instructionsExecuted = 0;
+    uint64_t slicesRun = 0;
+
+    // Hibernated VMs have released their CPU and program; only the fields
+    // below and the config stay resident until the state file is restored.
+    bool hibernated = false;
+    std::string hibernatePath;
+    int hibernatedVMID = 0;
+    size_t detachedProgramSize = 0; // program size while instructions is null
+    bool lost = false;
+    bool retired = false; // finished or migrated and handed back to the hypervisor
+
+    // set while the hypervisor records or replays; logIndex is this VM's slot in the log
+    ExecutionLog* executionLog = nullptr;
+    size_t logIndex = 0;
+
+    Profiler* profiler = nullptr;
+    uint32_t profileSlot = 0;
+
+    TranslatedProgram translatedProgram = nullptr; // from the AOT cache, if enabled
+    std::shared_ptr<const PendingTranslation> pendingTranslation; // interpreted until it's ready
+
+    bool verified = false; // program passed verifyProgram, run on verifiedHandlers
+
+    std::chrono::steady_clock::time_point arrivedAt; // when migrated in, for the balancer cooldown
+
+    SnapshotStore* snapshotStore = nullptr; // snapshots go to the store as manifests when set
+    ProgramCache* programCache = nullptr; // when set, waking shares the program resident VMs use
+
+public:
+    VM(Config c) : config(std::move(c)), cpu(std::make_unique<CPU>(config.vmID)), currentInstructionIndex(0) {
+        loadInstructions();
+    }
+
+    VM(Config c, std::unique_ptr<CPU> snapshotCPU) : cpu(std::move(snapshotCPU)), config(std::move(c)), currentInstructionIndex(0) {
+        loadInstructions();
+    }
+
+    VM(Config c, std::unique_ptr<CPU> snapshotCPU, int current_instruction_index) : cpu(std::move(snapshotCPU)),
+            config(std::move(c)), currentInstructionIndex(current_instruction_index) {
+        loadInstructions();
+    }
+
+    // program already parsed by the caller
+    VM(Config c, std::unique_ptr<CPU> snapshotCPU, int current_instruction_index, SharedProgram program) :
+            cpu(std::move(snapshotCPU)), config(std::move(c)), instructions(std::move(program)),
+            currentInstructionIndex(current_instruction_index) {
+    }
+
+    // Program from an image file, shared through the cache when one is attached
+    bool loadProgramImage(const std::string& imagePath) {
+        auto parse = [&imagePath](std::vector<Instruction>& image) {
+            bool opened;
+            image = parseProgramImage(imagePath, &opened);
+            return opened;
+        };
+        if (programCache != nullptr) {
+            instructions = programCache->get(imagePath, parse);
+            return instructions != nullptr;
+        }
+        std::vector<Instruction> image;
+        if (!parse(image)) {
+            return false;
+        }
+        instructions = std::make_shared<const std::vector<Instruction>>(std::move(image));
+        return true;
+    }
+
+    // false if vm_binary couldn't be read; the program is then left empty
+    bool loadInstructions() {
+        if (programCache != nullptr && (!instructions || instructions->empty())) {
+            instructions = programCache->load(config.vm_binary);
+            if (!instructions) {
+                instructions = std::make_shared<const std::vector<Instruction>>();
+                return false;
+            }
+            return true;
+        }
+
+        bool opened = false;
+        std::vector<Instruction> program = parseProgramFile(config.vm_binary, &opened);
+        if (instructions && !instructions->empty()) {
+            program.insert(program.begin(), instructions->begin(), instructions->end());
+        }
+        instructions = std::make_shared<const std::vector<Instruction>>(std::move(program));
+        return opened;
+    }
+
+    const std::vector<Instruction>& getInstructions() const {
+        return *instructions;
+    }
+
+    const SharedProgram& getProgram() const {
+        return instructions;
+    }
+
+    void setProgram(SharedProgram program) {
+        instructions = std::move(program);
+    }
+
+    // Drops the program of a VM that won't run here again; the last VM using it frees it
+    void releaseProgram() {
+        if (instructions) {
+            detachedProgramSize = instructions->size();
+            instructions.reset();
+        }
+    }
+
+    void changeVMID(int vmID) {
+        cpu->changeVMID(vmID);
+    }
+
+    void snapshot(const std::string& outputPath) {
+        std::cout << "Creating snapshot: " << outputPath << ", pc: " << cpu->pc << std::endl;
+        writeSnapshot(outputPath, cpu->pc);
+        cpu->pc++;
+    }
+
+    // Snapshot requested from outside the guest at a slice boundary. Restores resume
+    // after the recorded pc, so record the last instruction that completed.
+    bool snapshotAtBoundary(const std::string& outputPath) {
+        std::cout << "Creating snapshot: " << outputPath << ", pc: " << cpu->pc << std::endl;
+        return writeSnapshot(outputPath, static_cast<uint32_t>(currentInstructionIndex) - 1);
+    }
+
+    bool writeSnapshot(const std::string& outputPath, uint32_t pc) const {
+        std::ostringstream registers;
+        for (int i = 0; i < cpu->registers.size(); i++) {
+            registers << "R" << i << "=" << cpu->registers.at(i) << "\n";
+        }
+
+        if (snapshotStore != nullptr) {
+            return snapshotStore->write(outputPath, registers.str(), pc, config.vm_binary, instructions, [this]() {
+                return programImage();
+            });
+        }
+
+        std::ofstream outFile(outputPath);
+
+        if (!outFile.is_open()) {
+            std::cerr << "Couldn't write to file: " << outputPath << std::endl;
+            return false;
+        }
+
+        outFile << registers.str();
+        outFile << "pc=" << pc << "\n";
+        outFile << "binary=" << config.vm_binary << "\n";
+
+        outFile.close();
+        return true;
+    }
+
+    // resumeIndex is the instruction the receiver continues from.
+    // programByReference writes only the binary path when the program came from one,
+    // which is enough for state that is restored on this host.
+    std::string serialize(int resumeIndex, bool programByReference = false) const {
+        std::ostringstream oss;
+        oss << "curr_inst_index=" << resumeIndex << "\n";
+        oss << "slice_instructions=" << config.vm_exec_slice_in_instructions << "\n";
+
+        if (programByReference && !config.vm_binary.empty()) {
+            oss << "binary=" << config.vm_binary << "\n";
+        } else {
+            // serialize instructions
+            for (int i = 0; instructions && i < instructions->size(); i++) {
+                oss << "instruction=";
+                oss << instToString((*instructions)[i]) << "\n";
+            }
+        }
+
+        oss << cpu->serialize();
+
+        return oss.str();
+    }
+
+    // Same without the program, for callers storing each program once for many VMs
+    std::string serializeState(int resumeIndex) const {
+        std::ostringstream oss;
+        oss << "curr_inst_index=" << resumeIndex << "\n";
+        oss << "slice_instructions=" << config.vm_exec_slice_in_instructions << "\n";
+        oss << cpu->serialize();
+        return oss.str();
+    }
+
+    // The program in the inline form serialize uses, read back by parseProgramImage
+    std::string programImage() const {
+        return instructions ? programImage(*instructions) : std::string();
+    }
+
+    static std::string programImage(const std::vector<Instruction>& program) {
+        std::string image;
+        for (const auto& inst : program) {
+            image += "instruction=" + instToString(inst) + "\n";
+        }
+        return image;
+    }
+
+    static std::vector<Instruction> parseProgramImage(const std::string& imagePath, bool* opened = nullptr) {
+        std::vector<Instruction> program;
+        std::ifstream file(imagePath);
+        if (opened != nullptr) {
+            *opened = file.is_open();
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.rfind("instruction=", 0) == 0) {
+                program.emplace_back(stringToInst(line.substr(std::strlen("instruction="))));
+            }
+        }
+        return program;
+    }
+
+    static std::string instToString(const Instruction& inst) {
+        std::ostringstream oss;
+
+        // serialize inst type
+        switch(inst.instructionType) {
+            // ARITHMETIC
+            case InstructionType::ADD:
+                oss << "add";
+                break;
+            case InstructionType::SUB:
+                oss << "sub";
+                break;
+            case InstructionType::ADDI:
+                oss << "addi";
+                break;
+            case InstructionType::ADDU: {
+                oss << "addu";
+                break;
+            }
+            case InstructionType::SUBU: {
+                oss << "subu";
+                break;
+            }
+            case InstructionType::ADDIU: {
+                oss << "addiu";
+                break;
+            }
+            case InstructionType::MUL: { // Result in 32-bit integer
+                oss << "mul";
+                break;
+            }
+            case InstructionType::MULT: {
+                oss << "mult";
+                break;
+            }
+            case InstructionType::DIV: {
+                oss << "div";
+                break;
+            }
+
+            // LOGICAL
+            case InstructionType::AND:
+                oss << "and";
+                break;
+            case InstructionType::ANDI:
+                oss << "andi";
+                break;
+            case InstructionType::OR:
+                oss << "or";
+                break;
+            case InstructionType::ORI:
+                oss << "ori";
+                break;
+            case InstructionType::XOR:
+                oss << "xor";
+                break;
+            case InstructionType::XORI:
+                oss << "xori";
+                break;
+            case InstructionType::SLL:
+                oss << "sll";
+                break;
+            case InstructionType::SRL:
+                oss << "srl";
+                break;
+
+            // DATA
+            case InstructionType::LI:
+                oss << "li";
+                break;
+
+            // SPECIAL
+            case InstructionType::DUMP_PROCESSOR_STATE:
+                oss << "DUMP_PROCESSOR_STATE";
+                break;
+
+            case InstructionType::MIGRATE:
+                oss << "MIGRATE";
+                break;
+
+            case InstructionType::SNAPSHOT:
+                oss << "SNAPSHOT";
+                break;
+
+            default:
+                std::cerr << "Invalid MIPS inst being serialized" << std::endl;
+        }
+
+        // serialize operands
+        if (inst.instructionType == InstructionType::MIGRATE || inst.instructionType == InstructionType::SNAPSHOT) {
+            oss << "," << inst.path;
+        } else {
+            for (size_t j = 0; j < inst.operands.size(); j++) {
+                oss << "," << inst.operands[j];
+            }
+        }
+
+        return oss.str();
+    }
+
+    // false if the state names a binary that can't be read
+    // stateDir resolves program= files, which sit next to the state file
+    bool deserialize(std::string_view data, const std::string& stateDir = "") {
+        bool programLoaded = true;
+        // inline instructions are collected first and become the (shared) program in one piece
+        std::vector<Instruction> inlineProgram;
+        size_t inlineCount = 0;
+        for (size_t pos = data.find("instruction="); pos != std::string_view::npos; pos = data.find("instruction=", pos + 1)) {
+            inlineCount++;
+        }
+        inlineProgram.reserve(inlineCount);
+        auto adoptInlineProgram = [&]() {
+            if (inlineProgram.empty()) {
+                return;
+            }
+            if (instructions && !instructions->empty()) {
+                inlineProgram.insert(inlineProgram.begin(), instructions->begin(), instructions->end());
+            }
+            instructions = std::make_shared<const std::vector<Instruction>>(std::move(inlineProgram));
+            inlineProgram.clear();
+        };
+
+        // walk lines in place so a mapped migration region doesn't need to be copied first
+        size_t lineStart = 0;
+        while (lineStart < data.size()) {
+            size_t lineEnd = data.find('\n', lineStart);
+            if (lineEnd == std::string_view::npos) {
+                lineEnd = data.size();
+            }
+            std::string line(data.substr(lineStart, lineEnd - lineStart));
+            lineStart = lineEnd + 1;
+
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+
+            size_t eqPos = line.find('=');
+            if (eqPos == std::string::npos) {
+                continue;
+            }
+
+            std::string key = line.substr(0, eqPos);
+            std::string value = line.substr(eqPos + 1);
+
+            std::string remainingData = ""; // cpu specific data
+
+            if (key == "curr_inst_index") {
+                currentInstructionIndex = std::stoi(value);
+            } else if (key == "slice_instructions") {
+                config.vm_exec_slice_in_instructions = std::stoi(value);
+            } else if (key == "instruction") {
+                inlineProgram.emplace_back(stringToInst(value));
+            } else if (key == "binary") {
+                config.vm_binary = value;
+                adoptInlineProgram();
+                if (!loadInstructions()) {
+                    std::cerr << "Failed to load program " << value << std::endl;
+                    programLoaded = false;
+                }
+            } else if (key == "program") { // image written once for all VMs sharing it
+                std::string imagePath = stateDir.empty() ? value : stateDir + "/" + value;
+                if (!loadProgramImage(imagePath)) {
+                    std::cerr << "Failed to load program " << imagePath << std::endl;
+                    programLoaded = false;
+                }
+            } else if (key == "vm_binary") { // name only, instructions are inline or in a program= file
+                config.vm_binary = value;
+            } else if (key == "executed") {
+                instructionsExecuted = std::stoull(value);
+            } else if (key == "slices") {
+                slicesRun = std::stoull(value);
+            } else {
+                remainingData = line + "\n";
+            }
+
+            cpu->deserialize(remainingData);
+        }
+        adoptInlineProgram();
+        return programLoaded;
+    }
+
+    static Instruction stringToInst(const std::string& instStr) {
+        Instruction inst;
+        std::istringstream iss(instStr);
+        std::string token;
+
+        if (!std::getline(iss, token, ',')) {
+            inst.instructionType = InstructionType::INVALID;
+            return inst;
+        }
+
+        inst.instructionType = getInstructionType(token);
+
+        while (std::getline(iss, token, ',')) {
+            if (inst.instructionType == InstructionType::MIGRATE || inst.instructionType == InstructionType::SNAPSHOT) {
+                inst.path = token;
                 break;
+            } else {
+                try {
+                    if (!inst.operands.push_back(std::stoi(token))) {
+                        std::cerr << "Too many operands in inst" << instStr << std::endl;
+                        inst.instructionType = InstructionType::INVALID;
+                        break;
+                    }
+                } catch (const std::exception& e) {
+                    std::cerr << "Invalid operand in inst" << instStr << std::endl;
+                }
+            }
+        }
+        return inst;
+    }
+
+    // atBoundary: requested between slices, so the current instruction hasn't run yet
+    // (a guest MIGRATE instruction is skipped by the receiver instead)
+    void migrate(const std::string& target, bool atBoundary = false) {
+        int resumeIndex = atBoundary ? currentInstructionIndex : currentInstructionIndex + 1;
+        std::string targetStr = target;
+
+        if (!targetStr.empty() && targetStr.front() == '[' && targetStr.back() == ']') {
+            targetStr = targetStr.substr(1, targetStr.size() - 2); // stripping brackets from ip:port
+        }
+
+        std::cout << "Migration target: " << target << std::endl;
+
+        if (executionLog != nullptr && executionLog->isReplaying()) { // the outcome comes from the log
+            return;
+        }
+
+        if (targetStr.rfind("unix:", 0) == 0) { // same-host hypervisor
+            migrateLocal(targetStr.substr(5), resumeIndex);
+            return;
+        }
+
+        size_t colonPos = targetStr.find(':');
+        if (colonPos == std::string::npos) {
+            std::cerr << "Invalid migration format. Expecting IP:PORT" << std::endl;
+            return;
+        }
+
+        // IP and Port
+        std::string ip = targetStr.substr(0, colonPos);
+        int port = std::stoi(targetStr.substr(colonPos + 1)); // TODO - add support for brackets
+
+        // Serialize VM
+        std::string serializedState = serialize(resumeIndex);
+        uint32_t dataSize = htonl(static_cast<uint32_t>(serializedState.size()));
+
+        // Create socket
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            perror("socket");
+            return;
+        }
+
+        // Server address
+        struct sockaddr_in serverAddr;
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(port);
+        if (inet_pton(AF_INET, ip.c_str(), &serverAddr.sin_addr) <= 0) {
+            std::cerr << "Invalid IP addr format: " << ip << std::endl;
+            close(sock);
+            return;
+        }
+
+        // connect to target hypervisor
+        if (connect(sock, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+            perror("connect");
+            close(sock);
+            return;
+        }
+
+        // send data size
+        if (send(sock, &dataSize, sizeof(dataSize), 0) != sizeof(dataSize)) {
+            perror("send data size");
+            close(sock);
+            return;
+        }
+
+        // send serialized data
+        size_t totalSent = 0;
+        while (totalSent < serializedState.size()) {
+            ssize_t sent = send(sock, serializedState.c_str() + totalSent, serializedState.size() - totalSent, 0);
+            if (sent < 0) {
+                perror("send data");
+                close(sock);
+                return;
+            }
+            totalSent += sent;
+        }
+
+        std::cout << "VM " << cpu->VMID << " migrated to " << ip << ":" << port << std::endl;
+        close(sock);
+        migrated = true;
+    }
+
+    // Same-host migration. The state is laid out in a memfd and only the descriptor
+    // is passed over the unix socket (SCM_RIGHTS); the receiver maps it in directly.
+    // The small text state comes first, then the program encoded in place in binary
+    // form. The memfd is sealed before it's sent, so the receiver's mapping can't
+    // change or shrink under it.
+    void migrateLocal(const std::string& socketPath, int resumeIndex) {
+        std::string state = serializeState(resumeIndex) + "vm_binary=" + config.vm_binary + "\n";
+        size_t programBytes = instructions ? encodedProgramSize(*instructions) : 0;
+        size_t dataSize = state.size() + programBytes;
+        if (dataSize > UINT32_MAX) {
+            std::cerr << "VM " << cpu->VMID << " is too large to migrate" << std::endl;
+            return;
+        }
+
+        int memFd = memfd_create("vmm_migrate", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (memFd < 0) {
+            perror("memfd_create");
+            return;
+        }
+
+        if (ftruncate(memFd, static_cast<off_t>(dataSize)) < 0) {
+            perror("ftruncate");
+            close(memFd);
+            return;
+        }
+
+        void* region = mmap(nullptr, dataSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+        if (region == MAP_FAILED) {
+            perror("mmap");
+            close(memFd);
+            return;
+        }
+        char* out = std::copy(state.begin(), state.end(), static_cast<char*>(region));
+        if (instructions) {
+            encodeProgram(*instructions, out);
+        }
+        munmap(region, dataSize);
+
+        if (fcntl(memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+            perror("fcntl F_ADD_SEALS");
+            close(memFd);
+            return;
+        }
+
+        struct sockaddr_un serverAddr{};
+        serverAddr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(serverAddr.sun_path)) {
+            std::cerr << "Unix socket path too long: " << socketPath << std::endl;
+            close(memFd);
+            return;
+        }
+        std::strncpy(serverAddr.sun_path, socketPath.c_str(), sizeof(serverAddr.sun_path) - 1);
+
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0) {
+            perror("socket");
+            close(memFd);
+            return;
+        }
+
+        if (connect(sock, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+            perror("connect");
+            close(sock);
+            close(memFd);
+            return;
+        }
+
+        // the sizes travel inline, the memfd travels as ancillary data
+        uint32_t dataSizeMsg[2] = {static_cast<uint32_t>(state.size()), static_cast<uint32_t>(programBytes)};
+        struct iovec iov;
+        iov.iov_base = dataSizeMsg;
+        iov.iov_len = sizeof(dataSizeMsg);
+
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        struct msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &memFd, sizeof(int));
+
+        if (sendmsg(sock, &msg, 0) != sizeof(dataSizeMsg)) {
+            perror("sendmsg");
+            close(sock);
+            close(memFd);
+            return;
+        }
+
+        std::cout << "VM " << cpu->VMID << " migrated to unix:" << socketPath << std::endl;
+        close(sock);
+        close(memFd);
+        migrated = true;
+    }
+
+    bool run(int contextSwitch) {
+        if (migrated) { // the peer runs it now
+            return false;
+        }
+        if (pendingTranslation && pendingTranslation->ready.load(std::memory_order_acquire)) {
+            translatedProgram = pendingTranslation->entry;
+            pendingTranslation.reset();
+        }
+        int startIndex = currentInstructionIndex;
+        int size = static_cast<int>(programSize()); // a released program is only ever past its end
+        int i = 0;
+        for (; i < contextSwitch && currentInstructionIndex < size; i++) {
+            if (translatedProgram != nullptr) {
+                int budget = std::min<int>(contextSwitch - i, size - currentInstructionIndex);
+                int executed = translatedProgram(cpu->registers.data(), &cpu->hi, &cpu->lo, currentInstructionIndex, budget);
+                cpu->pc += executed;
+                currentInstructionIndex += executed;
+                i += executed;
+                if (executed == budget) {
+                    break;
+                }
+                // otherwise the translation stopped at an instruction the interpreter handles
+            }
+
+            const Instruction& inst = (*instructions)[currentInstructionIndex]; // bounded by the loop condition
+            if (inst.instructionType == InstructionType::SNAPSHOT) {
+                if (executionLog != nullptr) {
+                    executionLog->guestEvent(logIndex, InstructionType::SNAPSHOT, currentInstructionIndex);
+                }
+                snapshot(inst.path);
+            } else if (inst.instructionType == InstructionType::MIGRATE) {
+                if (executionLog != nullptr) {
+                    executionLog->guestEvent(logIndex, InstructionType::MIGRATE, currentInstructionIndex);
+                }
+                migrate(inst.path);
+                migrated = true;
+            } else if (verified) {
+                verifiedHandlers[static_cast<size_t>(inst.instructionType)](*cpu, inst);
+            } else {
+                cpu->execute(inst);
+            }
+            currentInstructionIndex++;
+        }
+        if (profiler != nullptr && i > 0) {
+            profiler->sampleSlice(profileSlot, startIndex, instructionsExecuted, i);
+        }
+        instructionsExecuted += i;
+        slicesRun++;
+        return !migrated && currentInstructionIndex < size; // end process after migration on sender
+//        return currentInstructionIndex < size; // continue process after migration
+    }
+
+    bool isMigrated() const {
+        return migrated;
+    }
+
+    void markMigrated() {
+        migrated = true;
+    }
+
+    void attachExecutionLog(ExecutionLog* log, size_t index) {
+        executionLog = log;
+        logIndex = index;
+    }
+
+    // Called whenever the program is (re)loaded; unverified programs stay on the checked path
+    bool verify() {
+        size_t index;
+        std::string reason;
+        verified = verifyProgram(*instructions, index, reason);
+        if (!verified) {
+            std::cerr << "VM " << getVMID() << " program failed verification at instruction " << index
+                      << " (" << reason << "), using the checked interpreter" << std::endl;
+        }
+        return verified;
+    }
+
+    bool isVerified() const {
+        return verified;
+    }
+
+    void attachTranslation(std::shared_ptr<const PendingTranslation> translation) {
+        translatedProgram = nullptr;
+        pendingTranslation = std::move(translation);
+    }
+
+    void attachSnapshotStore(SnapshotStore* store) {
+        snapshotStore = store;
+    }
+
+    void attachProgramCache(ProgramCache* cache) {
+        programCache = cache;
+    }
+
+    void attachProfiler(Profiler* p, uint32_t slot) {
+        profiler = p;
+        profileSlot = slot;
+    }
+
+    size_t getLogIndex() const {
+        return logIndex;
+    }
+
+    uint64_t getInstructionsExecuted() const {
+        return instructionsExecuted;
+    }
+
+    int getCurrInstIndex() const {
+        return currentInstructionIndex;
+    }
+
+    Config getConfig() {
+        return this->config;
+    }
+
+    int getSliceSize() const {
+        return config.vm_exec_slice_in_instructions;
+    }
+
+    void setSliceSize(int sliceSize) {
+        config.vm_exec_slice_in_instructions = sliceSize;
+    }
+
+    int getVMID() const {
+        return hibernated ? hibernatedVMID : cpu->VMID;
+    }
+
+    size_t programSize() const {
+        return instructions ? instructions->size() : detachedProgramSize;
+    }
+
+    bool isHibernated() const {
+        return hibernated;
+    }
+
+    // state file couldn't be restored; the scheduler skips the VM and the run fails
+    void markLost() {
+        lost = true;
+    }
+
+    bool isLost() const {
+        return lost;
+    }
+
+    void markRetired() {
+        retired = true;
+    }
+
+    bool isRetired() const {
+        return retired;
+    }
+
+    // Approximate heap held by a resident VM, used against the hypervisor watermark.
+    // A shared program is split evenly between the VMs using it.
+    size_t residentBytes() const {
+        size_t bytes = sizeof(VM) + sizeof(CPU);
+        if (instructions) {
+            bytes += instructions->capacity() * sizeof(Instruction) / instructions.use_count();
+        }
+        return bytes;
+    }
+
+    // Writes everything needed to rebuild this VM (hibernation, checkpoints). Without
+    // programFile only the binary path is kept, which is enough for hibernation in this
+    // process. Checkpoints write each program once next to the state files and pass its
+    // name here (empty for a released program), so they restore from any directory.
+    bool saveState(const std::string& path, const std::string* programFile = nullptr) const {
+        if (hibernated && programFile != nullptr) { // rebuild the cold VM, its program comes from the cache
+            VM cold(Config(), std::make_unique<CPU>(hibernatedVMID));
+            cold.attachProgramCache(programCache);
+            if (!cold.loadState(hibernatePath)) {
+                return false;
+            }
+            cold.setSliceSize(config.vm_exec_slice_in_instructions);
+            return cold.saveState(path, programFile);
+        }
+        if (hibernated) { // the state file already exists, only the slice size may be newer
+            std::error_code ec;
+            if (!std::filesystem::copy_file(hibernatePath, path, std::filesystem::copy_options::overwrite_existing, ec)) {
+                std::cerr << "Couldn't copy " << hibernatePath << " to " << path << ": " << ec.message() << std::endl;
+                return false;
+            }
+            std::ofstream outFile(path, std::ios::app);
+            outFile << "slice_instructions=" << config.vm_exec_slice_in_instructions << "\n";
+            return static_cast<bool>(outFile);
+        }
+
+        std::ofstream outFile(path, std::ios::trunc);
+        if (!outFile.is_open()) {
+            std::cerr << "Couldn't write to file: " << path << std::endl;
+            return false;
+        }
+
+        if (programFile == nullptr) {
+            outFile << serialize(currentInstructionIndex, true);
+        } else {
+            outFile << serializeState(currentInstructionIndex);
+            if (!programFile->empty()) {
+                outFile << "program=" << *programFile << "\n";
+            }
+            if (!config.vm_binary.empty()) {
+                outFile << "vm_binary=" << config.vm_binary << "\n"; // name only, kept for SNAPSHOT
+            }
+        }
+        outFile << "executed=" << instructionsExecuted << "\n";
+        outFile << "slices=" << slicesRun << "\n";
+        outFile.close();
+        if (!outFile) {
+            std::cerr << "Couldn't write to file: " << path << std::endl;
+            std::filesystem::remove(path);
+            return false;
+        }
+        return true;
+    }
+
+    // Counterpart of saveState for a freshly constructed VM
+    bool loadState(const std::string& path) {
+        std::ifstream inFile(path);
+        if (!inFile.is_open()) {
+            std::cerr << "Failed to open state file: " << path << std::endl;
+            return false;
+        }
+        std::stringstream buffer;
+        buffer << inFile.rdbuf();
+        return deserialize(buffer.str(), std::filesystem::path(path).parent_path().string());
+    }
+
+    // Moves the CPU state and program into a state file and frees them
+    bool hibernate(const std::string& path) {
+        if (!saveState(path)) {
+            return false;
+        }
+
+        hibernatedVMID = cpu->VMID;
+        cpu.reset();
+        releaseProgram();
+        hibernatePath = path;
+        hibernated = true;
+        return true;
+    }
+
+    bool wake() {
+        // slice size may have been changed over the control socket while cold
+        int sliceSize = config.vm_exec_slice_in_instructions;
+        cpu = std::make_unique<CPU>(hibernatedVMID);
+        hibernated = false;
+        if (!loadState(hibernatePath)) {
+            cpu.reset();
+            hibernated = true;
+            return false;
+        }
+        config.vm_exec_slice_in_instructions = sliceSize;
+        if (verified) { // the binary is re-read, so prove it again
+            verify();
+        }
+
+        std::filesystem::remove(hibernatePath);
+        hibernatePath.clear();
+        return true;
+    }
+
+    // drop the state file of a VM that is never restored
+    void discardHibernation() {
+        if (hibernated) {
+            std::filesystem::remove(hibernatePath);
+        }
+    }
+
+    bool isPaused() const {
+        return paused;
+    }
+
+    void setPaused(bool p) {
+        paused = p;
+    }
+
+    bool isFinished() const {
+        return currentInstructionIndex >= programSize();
+    }
+
+    uint64_t remainingInstructions() const {
+        return isFinished() ? 0 : programSize() - currentInstructionIndex;
+    }
+
+    void markArrived() {
+        arrivedAt = std::chrono::steady_clock::now();
+    }
+
+    std::chrono::steady_clock::time_point getArrivedAt() const {
+        return arrivedAt;
+    }
+
+    std::string stateName() const {
+        if (hibernated && !migrated && !isFinished()) {
+            return paused ? "paused,hibernated" : "hibernated";
+        } else if (migrated) {
+            return "migrated";
+        } else if (isFinished()) {
+            return "finished";
+        } else if (paused) {
+            return "paused";
+        }
+        return "running";
+    }
+
+    std::string statusLine() const {
+        std::ostringstream oss;
+        oss << "vm=" << getVMID() << " state=" << stateName() << " slice=" << config.vm_exec_slice_in_instructions
+            << " binary=" << config.vm_binary;
+        return oss.str();
+    }
+
+    std::string statsLine() const {
+        std::ostringstream oss;
+        oss << "vm=" << getVMID() << " state=" << stateName();
+        if (!hibernated) {
+            oss << " pc=" << cpu->pc;
+        }
+        oss << " inst_index=" << currentInstructionIndex << "/" << programSize()
+            << " executed=" << instructionsExecuted << " slices=" << slicesRun;
+        return oss.str();
+    }
+
+    std::unique_ptr<CPU> releaseCPU() {
+        return std::move(cpu);
+    }
+
+    static void* operator new(size_t size);
+    static void operator delete(void* p, size_t size);
+};
+
+void* VM::operator new(size_t size) {
+    return SlabPool<VM>::allocate(size);
+}
+
+void VM::operator delete(void* p, size_t size) {
+    SlabPool<VM>::release(p, size);
+}
+
+// Ahead-of-time translation cache. A program's decoded instructions are emitted as
+// straight-line C++, compiled into a shared object in cacheDir and dlopen'ed. Objects
+// are keyed by a hash of the program and VMM_VERSION, so later runs, snapshot
+// restores and migration receivers load an existing translation without compiling.
+// Missing objects are compiled on a background thread; VMs keep interpreting meanwhile.
+class TranslationCache {
+public:
+    explicit TranslationCache(std::string dir) : cacheDir(std::move(dir)) {}
+
+    ~TranslationCache() {
+        for (auto& compileThread : compiles) {
+            compileThread.join();
+        }
+        for (void* handle : handles) {
+            dlclose(handle);
+        }
+    }
+
+    bool init() {
+        std::error_code ec;
+        std::filesystem::create_directories(cacheDir, ec);
+        if (ec) {
+            std::cerr << "Couldn't create AOT cache directory " << cacheDir << ": " << ec.message() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // nullptr when the program can't be translated; the VM then stays on the interpreter
+    std::shared_ptr<const PendingTranslation> translate(const SharedProgram& program) {
+        if (!program || program->empty()) {
+            return nullptr;
+        }
+
+        uint64_t hash = programHash(*program);
+        auto loaded = programs.find(hash);
+        if (loaded != programs.end()) { // also the failures, so they aren't retried for every VM
+            return loaded->second;
+        }
+        auto translation = std::make_shared<PendingTranslation>();
+        programs[hash] = translation;
+
+        std::ostringstream name;
+        name << cacheDir << "/aot_" << std::hex << std::setw(16) << std::setfill('0') << hash << "_v" << VMM_VERSION;
+        std::string objectPath = name.str() + ".so";
+
+        if (std::filesystem::exists(objectPath)) {
+            translation->entry = load(objectPath);
+            translation->ready = true;
+            return translation;
+        }
+
+        // the compiler can take seconds on a big program, far too long for the scheduler thread
+        compiles.emplace_back([this, program, baseName = name.str(), objectPath, translation]() {
+            if (compile(*program, baseName, objectPath)) {
+                translation->entry = load(objectPath);
+            }
+            translation->ready.store(true, std::memory_order_release);
+        });
+        return translation;
+    }
+
+private:
+    static constexpr int CHUNK_SIZE = 256; // instructions per generated function, keeps compile time sane
+
+    std::string cacheDir;
+    std::unordered_map<uint64_t, std::shared_ptr<PendingTranslation>> programs;
+    std::vector<std::thread> compiles;
+    std::mutex handlesMutex;
+    std::vector<void*> handles; // guarded by handlesMutex
+
+    TranslatedProgram load(const std::string& objectPath) {
+        void* handle = dlopen(objectPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (handle == nullptr) {
+            std::cerr << "Couldn't load translation " << objectPath << ": " << dlerror() << std::endl;
+            return nullptr;
+        }
+        {
+            std::lock_guard<std::mutex> lock(handlesMutex);
+            handles.push_back(handle);
+        }
+
+        auto entry = reinterpret_cast<TranslatedProgram>(dlsym(handle, "vmm_aot_run"));
+        if (entry == nullptr) {
+            std::cerr << "Translation " << objectPath << " has no entry point" << std::endl;
+        }
+        return entry;
+    }
+
+    // FNV-1a over the decoded program and the VMM version
+    static uint64_t programHash(const std::vector<Instruction>& program) {
+        uint64_t hash = 1469598103934665603ULL;
+        auto mix = [&hash](const void* data, size_t size) {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            for (size_t n = 0; n < size; n++) {
+                hash ^= bytes[n];
+                hash *= 1099511628211ULL;
+            }
+        };
+        mix(VMM_VERSION, sizeof(VMM_VERSION));
+        for (const auto& inst : program) {
+            int fields[2] = {static_cast<int>(inst.instructionType), static_cast<int>(inst.operands.size())};
+            mix(fields, sizeof(fields));
+            mix(inst.operands.data(), inst.operands.size() * sizeof(int));
+        }
+        return hash;
+    }
+
+    // C++ for one instruction at index i, or an early return for anything left to the interpreter
+    static std::string emit(const Instruction& inst) {
+        const std::string fallback = "return i;";
+        if (!verifyInstruction(inst)) {
+            return fallback;
+        }
+
+        const InstructionOperands& op = inst.operands;
+        auto reg = [&op](size_t n) { return "r[" + std::to_string(op[n]) + "]"; };
+        auto imm = [&op](size_t n) { return std::to_string(op[n]); };
+
+        switch (inst.instructionType) {
+            case InstructionType::ADD:
+            case InstructionType::ADDU:
+                return reg(0) + " = " + reg(1) + " + " + reg(2) + ";";
+            case InstructionType::SUB:
+            case InstructionType::SUBU:
+                return reg(0) + " = " + reg(1) + " - " + reg(2) + ";";
+            case InstructionType::MUL:
+                return reg(0) + " = " + reg(1) + " * " + reg(2) + ";";
+            case InstructionType::AND:
+                return reg(0) + " = " + reg(1) + " & " + reg(2) + ";";
+            case InstructionType::OR:
+                return reg(0) + " = " + reg(1) + " | " + reg(2) + ";";
+            case InstructionType::XOR:
+                return reg(0) + " = " + reg(1) + " ^ " + reg(2) + ";";
+            case InstructionType::ADDI:
+            case InstructionType::ADDIU:
+                return reg(0) + " = " + reg(1) + " + " + imm(2) + ";";
+            case InstructionType::ANDI:
+                return reg(0) + " = " + reg(1) + " & " + imm(2) + ";";
+            case InstructionType::ORI:
+                return reg(0) + " = " + reg(1) + " | " + imm(2) + ";";
+            case InstructionType::XORI:
+                return reg(0) + " = " + reg(1) + " ^ " + imm(2) + ";";
+            case InstructionType::SLL:
+                return reg(0) + " = " + reg(1) + " << " + imm(2) + ";";
+            case InstructionType::SRL:
+                return reg(0) + " = " + reg(1) + " >> " + imm(2) + ";";
+            case InstructionType::MULT:
+                return "{ int64_t res = " + reg(1) + " * " + reg(2) + "; *hi = static_cast<int32_t>(res >> 32); *lo = static_cast<int32_t>(res); }";
+            case InstructionType::DIV: // divide by zero is reported by the interpreter
+                return "if (" + reg(2) + " == 0) return i; *lo = " + reg(1) + " / " + reg(2) + "; *hi = " + reg(1) + " % " + reg(2) + ";";
+            case InstructionType::LI:
+                return reg(0) + " = " + imm(1) + ";";
+            default: // SNAPSHOT, MIGRATE, DUMP_PROCESSOR_STATE
+                return fallback;
+        }
+    }
+
+    static bool compile(const std::vector<Instruction>& program, const std::string& baseName, const std::string& objectPath) {
+        std::string tmpBase = baseName + ".tmp" + std::to_string(getpid());
+        std::string sourcePath = tmpBase + ".cc";
+        std::string tmpObjectPath = tmpBase + ".so";
+
+        std::ofstream source(sourcePath, std::ios::trunc);
+        if (!source.is_open()) {
+            std::cerr << "Couldn't write to file: " << sourcePath << std::endl;
+            return false;
+        }
+
+        // Each chunk runs from i until end, the end of its chunk, or an instruction it leaves to the interpreter
+        int chunks = (static_cast<int>(program.size()) + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        source << "// generated by VMM " << VMM_VERSION << ", do not edit\n#include <cstdint>\n\n";
+        for (int chunk = 0; chunk < chunks; chunk++) {
+            int first = chunk * CHUNK_SIZE;
+            int last = std::min<int>(first + CHUNK_SIZE, static_cast<int>(program.size()));
+            source << "static int chunk" << chunk << "(int* r, uint32_t* hi, uint32_t* lo, int i, int end) {\n"
+                   << "    switch (i) {\n";
+            for (int n = first; n < last; n++) {
+                source << "    case " << n << ": if (i == end) return i; " << emit(program[n]) << " i++; [[fallthrough]];\n";
+            }
+            source << "    default: return i;\n    }\n}\n\n";
+        }
+
+        source << "using Chunk = int (*)(int*, uint32_t*, uint32_t*, int, int);\n"
+               << "static const Chunk chunks[] = {";
+        for (int chunk = 0; chunk < chunks; chunk++) {
+            source << (chunk == 0 ? "" : ", ") << "chunk" << chunk;
+        }
+        source << "};\n\n"
+               << "extern \"C\" int vmm_aot_run(int* r, uint32_t* hi, uint32_t* lo, int start, int count) {\n"
+               << "    int i = start;\n"
+               << "    const int end = start + count;\n"
+               << "    while (i < end) {\n"
+               << "        int chunkEnd = (i / " << CHUNK_SIZE << " + 1) * " << CHUNK_SIZE << ";\n"
+               << "        int stop = chunks[i / " << CHUNK_SIZE << "](r, hi, lo, i, end);\n"
+               << "        if (stop < end && stop < chunkEnd) {\n"
+               << "            return stop - start;\n"
+               << "        }\n"
+               << "        i = stop;\n"
+               << "    }\n"
+               << "    return i - start;\n"
+               << "}\n";
+        source.close();
+        if (!source) {
+            std::cerr << "Couldn't write to file: " << sourcePath << std::endl;
+            std::filesystem::remove(sourcePath);
+            return false;
+        }
+
+        // -fwrapv keeps integer overflow identical to the interpreter's wrapping behavior
+        const char* compiler = std::getenv("CXX");
+        std::string command = std::string(compiler != nullptr ? compiler : "c++") +
+                              " -std=c++17 -O1 -fwrapv -fPIC -shared -o '" + tmpObjectPath + "' '" + sourcePath + "'";
+        std::cout << "Compiling AOT translation " << objectPath << " (" << program.size() << " instructions)" << std::endl;
+        int status = std::system(command.c_str());
+        std::filesystem::remove(sourcePath);
+        if (status != 0) {
+            std::cerr << "AOT compile failed, using the interpreter: " << command << std::endl;
+            std::filesystem::remove(tmpObjectPath);
+            return false;
+        }
+
+        // rename so a concurrent VMM never loads a half-written object
+        std::error_code ec;
+        std::filesystem::rename(tmpObjectPath, objectPath, ec);
+        if (ec) {
+            std::cerr << "Couldn't install translation " << objectPath << ": " << ec.message() << std::endl;
+            std::filesystem::remove(tmpObjectPath);
+            return false;
+        }
+        return true;
+    }
+};
+
+// A line received on the control socket, answered by the scheduler thread
+struct ControlRequest {
+    std::string command;
+    std::promise<std::string> reply;
+};
+
+class Hypervisor {
+private:
+    std::vector<std::unique_ptr<VM>> vms;
+    // Slots of retired VMs (finished or migrated). The next VM that joins takes one
+    // over, freeing the old VM and CPU, so a long running balancer doesn't grow vms.
+    std::vector<size_t> freeSlots;
+    int highestVMID = 0; // across every VM that has been here, retired ones included
+
+    // Control plane: a separate thread serves the unix socket and queues requests.
+    // The scheduler only checks controlPending once per round and handles the
+    // queue between slices, so VMs are always quiesced when a command runs.
+    std::mutex controlMutex;
+    std::vector<std::unique_ptr<ControlRequest>> controlQueue;
+    std::atomic<bool> controlPending{false};
+    bool acceptingControl = true; // guarded by controlMutex
+    std::thread controlThread; // accepts clients, each one is served on its own thread
+    std::atomic<bool> controlRunning{false};
+    int controlListenSock = -1;
+    std::string controlSocketPath;
+
+    struct ControlClient {
+        int sock;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+    std::mutex controlClientsMutex;
+    std::condition_variable controlStopped; // cuts short the sleep between streamed stats
+    std::list<std::unique_ptr<ControlClient>> controlClients; // guarded by controlClientsMutex
+
+    // Hibernation: once resident VMs exceed the watermark the least recently
+    // scheduled ones are written to hibernateDir and restored when next picked.
+    // hibernateDir is private to this process (mkdtemp under -d), so hypervisors
+    // sharing a working directory never touch each other's state files.
+    size_t residentWatermarkBytes = 0; // 0 = hibernation off
+    std::string hibernateDir;
+    size_t lostVMs = 0; // hibernated VMs that couldn't be woken
+    size_t residentBytes = 0;
+    struct ResidentEntry {
+        std::list<size_t>::iterator lruPosition;
+        size_t bytes;
+    };
+    std::list<size_t> residentLRU; // vm indices, least recently scheduled first
+    std::unordered_map<size_t, ResidentEntry> residentVMs;
+
+    std::unique_ptr<ExecutionLog> executionLog; // set in record mode
+
+    std::unique_ptr<Profiler> profiler;
+    std::string profileFoldedPath;
+
+    std::unique_ptr<TranslationCache> translationCache; // set in AOT mode
+    std::unique_ptr<SnapshotStore> snapshotStore;       // set with -k
+    ProgramCache programCache; // programs by vm_binary, shared by the fleet and by waking VMs
+
+    // Load balancing across local hypervisors. The balancer thread receives migrated
+    // VMs (TCP) and load reports (UDP) on the -p port, sends our load to the peers and
+    // decides when to move a VM. Like control commands, incoming VMs and moves are
+    // handed to the scheduler and applied between rounds.
+    struct PeerLoad {
+        uint64_t queue = 0;     // runnable VMs
+        uint64_t remaining = 0; // instructions left across them
+        double ips = 0;         // instructions per second
+        std::chrono::steady_clock::time_point reportedAt;
+        bool reported = false;
+    };
+    std::vector<std::string> balancePeers; // ip:port
+    std::unordered_map<std::string, PeerLoad> peerLoads; // balancer thread only
+    int balanceTcpSock = -1;
+    int balanceUdpSock = -1;
+    int balancePort = 0;
+    std::thread balancerThread;
+    std::atomic<bool> balancerRunning{false};
+    std::atomic<bool> balancePending{false};
+    std::atomic<bool> balanceIdle{false}; // we and every peer have had nothing to run for a while
+    std::mutex balanceMutex;
+    std::vector<std::string> incomingStates; // guarded by balanceMutex
+    std::string pendingMoveTarget;           // guarded by balanceMutex
+    // published by the scheduler once per round
+    std::atomic<uint64_t> localQueue{0};
+    std::atomic<uint64_t> localRemaining{0};
+    std::atomic<uint64_t> localExecuted{0};
+    std::atomic<uint64_t> movesFinished{0};
+    std::atomic<int64_t> lastMoveFinishedAt{0}; // steady_clock ticks
+public:
+    Hypervisor() = default;
+    ~Hypervisor() {
+        stopControlServer();
+        stopBalancer();
+        for (auto& vm : vms) {
+            vm->discardHibernation();
+        }
+        if (!hibernateDir.empty()) {
+            std::error_code ec;
+            std::filesystem::remove(hibernateDir, ec); // only if empty, never someone else's files
+        }
+    }
+
+    bool enableHibernation(size_t watermarkBytes, const std::string& dir) {
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec) {
+            std::cerr << "Couldn't create hibernation directory " << dir << ": " << ec.message() << std::endl;
+            return false;
+        }
+        std::string privateDir = dir + "/vmm.XXXXXX";
+        if (mkdtemp(privateDir.data()) == nullptr) {
+            perror("mkdtemp");
+            return false;
+        }
+        residentWatermarkBytes = watermarkBytes;
+        hibernateDir = privateDir;
+        return true;
+    }
+
+    size_t getLostVMCount() const {
+        return lostVMs;
+    }
+
+    // Reads configs, parses programs and restores snapshots for the whole fleet across
+    // all cores, then adds the VMs in order. VM ids follow the order of vmFileConfigs.
+    bool startFleet(const std::vector<VMFileConfig>& vmFileConfigs, bool reportTiming) {
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::unique_ptr<VM>> fleet(vmFileConfigs.size());
+        std::atomic<bool> allLoaded{true};
+        int firstVMID = highestVMID + 1;
+        parallelFor(vmFileConfigs.size(), [&](size_t n) {
+            fleet[n] = buildVM(vmFileConfigs[n], firstVMID + static_cast<int>(n), programCache);
+            if (!fleet[n]) {
+                allLoaded = false;
+            }
+        });
+        if (!allLoaded) {
+            return false;
+        }
+
+        for (auto& vm : fleet) {
+            addVM(std::move(vm));
+        }
+
+        if (reportTiming) {
+            auto startupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Started " << vmFileConfigs.size() << " VMs in " << startupMs << " ms" << std::endl;
+        }
+        return true;
+    }
+
+    static std::unique_ptr<VM> buildVM(const VMFileConfig& vmFileConfig, int vmID, ProgramCache& programCache) {
+        Config config;
+        config.vmID = vmID;
+        if (!parseConfigFile(vmFileConfig.vmFile, config)) {
+            std::cerr << "Error parsing config assembly file" << std::endl;
+            return nullptr;
+        }
+        if (vmFileConfig.sliceInstructions > 0) {
+            config.vm_exec_slice_in_instructions = vmFileConfig.sliceInstructions;
+        }
+
+        std::unique_ptr<CPU> cpu;
+        int currentInstructionIndex = 0;
+        std::string programImage; // store snapshots also carry the program that ran
+        if (!vmFileConfig.snapshotFile.empty()) {
+            std::array<int, 32> registers{};
+            uint32_t pc;
+            std::string binaryFile;
+            if (!parseSnapshotFile(vmFileConfig.snapshotFile, registers, pc, binaryFile, &programImage)) {
+                std::cerr << "Error restoring snapshot " << vmFileConfig.snapshotFile << std::endl;
+                return nullptr;
+            }
+            cpu = std::make_unique<CPU>(registers, config.vmID);
+            pc++;
+            cpu->pc = pc;
+            if (config.vm_binary == binaryFile) { // Same assembly file -> continue from snapshot point
+                currentInstructionIndex = static_cast<int>(pc);
+            } else { // otherwise just use registers
+                programImage.clear();
+            }
+        } else {
+            cpu = std::make_unique<CPU>(config.vmID);
+        }
+
+        SharedProgram program = programImage.empty() ? programCache.get(config.vm_binary) :
+                programCache.get(programImage, [&programImage](std::vector<Instruction>& image) {
+                    bool opened;
+                    image = VM::parseProgramImage(programImage, &opened);
+                    return opened;
+                });
+        if (!program) {
+            std::cerr << "Failed to load program image " << programImage << std::endl;
+            return nullptr;
+        }
+        auto vm = std::make_unique<VM>(config, std::move(cpu), currentInstructionIndex, program);
+        vm->setPaused(vmFileConfig.startPaused);
+        return vm;
+    }
+
+    bool startRecording(const std::string& path) {
+        auto log = std::make_unique<ExecutionLog>();
+        if (!log->openForRecord(path)) {
+            return false;
+        }
+        executionLog = std::move(log);
+        return true;
+    }
+
+    void startProfiling(uint64_t sampleInterval, const std::string& foldedPath) {
+        profiler = std::make_unique<Profiler>(sampleInterval);
+        profileFoldedPath = foldedPath;
+        profiler->start();
+    }
+
+    // Prints the profile and writes the folded stacks
+    void finishProfiling() {
+        if (!profiler) {
+            return;
+        }
+        profiler->stop();
+        std::cout << profiler->report();
+        if (profiler->writeFolded(profileFoldedPath)) {
+            std::cout << "Folded stacks written to " << profileFoldedPath << std::endl;
+        }
+    }
+
+    bool enableTranslationCache(const std::string& dir) {
+        auto cache = std::make_unique<TranslationCache>(dir);
+        if (!cache->init()) {
+            return false;
+        }
+        translationCache = std::move(cache);
+        return true;
+    }
+
+    bool enableSnapshotStore(const std::string& dir) {
+        auto store = std::make_unique<SnapshotStore>(dir);
+        if (!store->open()) {
+            return false;
+        }
+        snapshotStore = std::move(store);
+        return true;
+    }
+
+    void attachTranslation(VM& vm) {
+        if (translationCache) {
+            vm.attachTranslation(translationCache->translate(vm.getProgram()));
+        }
+    }
+
+    void attachProfiler(VM& vm, size_t index) {
+        if (profiler) {
+            vm.attachProfiler(profiler.get(), static_cast<uint32_t>(index));
+            profiler->registerVM(static_cast<uint32_t>(index), vm.getVMID(), vm.getConfig().vm_binary);
+        }
+    }
+
+    void createVM(const Config& config) {
+       std::unique_ptr<VM> vm = std::make_unique<VM>(config);
+       addVM(std::move(vm));
+    }
+    void createVM(const Config& config, std::unique_ptr<CPU> cpu) {
+        std::unique_ptr<VM> vm = std::make_unique<VM>(config, std::move(cpu));
+        addVM(std::move(vm));
+    }
+    void createVM(const Config& config, std::unique_ptr<CPU> cpu, int current_instruction_index) {
+        std::unique_ptr<VM> vm = std::make_unique<VM>(config, std::move(cpu), current_instruction_index);
+        addVM(std::move(vm));
+    }
+
+    // Every VM joins through here so a recording sees its starting state
+    void addVM(std::unique_ptr<VM> vm) {
+        // the profiler reports per slot, so it keeps every VM's own
+        size_t index = vms.size();
+        if (!freeSlots.empty() && !profiler) {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        highestVMID = std::max(highestVMID, vm->getVMID());
+        if (executionLog) {
+            vm->attachExecutionLog(executionLog.get(), index);
+            // the program is logged too so replay doesn't depend on the files; the name is kept for SNAPSHOT
+            executionLog->restore(index, vm->serializeState(vm->getCurrInstIndex()) + "vm_binary=" + vm->getConfig().vm_binary + "\n",
+                                  vm->getProgram());
+        }
+        vm->verify();
+        attachProfiler(*vm, index);
+        attachTranslation(*vm);
+        vm->attachSnapshotStore(snapshotStore.get());
+        vm->attachProgramCache(&programCache);
+        if (index < vms.size()) {
+            vms[index]->discardHibernation();
+            vms[index] = std::move(vm);
+        } else {
+            vms.emplace_back(std::move(vm));
+        }
+        if (residentWatermarkBytes > 0) { // counted from the start, so parked VMs can be evicted too
+            touchVM(index);
+        }
+    }
+    void run() {
+        bool allVMSCompleted = false;
+        uint64_t executedTotal = 0;
+        while (!allVMSCompleted) {
+            if (controlPending.load(std::memory_order_acquire)) {
+                processControlRequests();
+            }
+            if (balancePending.load(std::memory_order_acquire)) {
+                processBalanceRequests();
+            }
+
+            allVMSCompleted = true;
+            bool anyVMRan = false;
+            uint64_t runnable = 0;
+            uint64_t remaining = 0;
+            for (int i = 0; i < vms.size(); i++) {
+                if (vms[i]->isLost() || vms[i]->isRetired()) {
+                    continue;
+                }
+                if (vms[i]->isPaused()) {
+                    allVMSCompleted = false; // paused VMs keep the hypervisor alive
+                    continue;
+                }
+                if (vms[i]->isHibernated()) {
+                    if (vms[i]->isFinished() || vms[i]->isMigrated()) {
+                        retireVM(i); // cold for good
+                        continue;
+                    }
+                    if (!wakeVM(i)) {
+                        std::cerr << "VM " << vms[i]->getVMID() << " lost: its hibernated state couldn't be restored" << std::endl;
+                        vms[i]->markLost();
+                        lostVMs++;
+                        continue;
+                    }
+                }
+                uint64_t executedBefore = vms[i]->getInstructionsExecuted();
+                bool vmHasMoreInstructions = vms.at(i)->run(vms.at(i)->getSliceSize());
+                uint64_t executed = vms[i]->getInstructionsExecuted() - executedBefore;
+                executedTotal += executed;
+                if (executionLog && executed > 0) {
+                    executionLog->slice(i, executed);
+                }
+                if (!vmHasMoreInstructions && (vms[i]->isFinished() || vms[i]->isMigrated())) {
+                    retireVM(i);
+                } else if (residentWatermarkBytes > 0 && vmHasMoreInstructions) {
+                    touchVM(i);
+                }
+                if (vmHasMoreInstructions) {
+                    allVMSCompleted = false;
+                    anyVMRan = true;
+                    runnable++;
+                    remaining += vms[i]->remainingInstructions();
+                    std::cout << "(VM: " << i + 1 << " running)" << std::endl;
+                }
+            }
+
+            if (balancerRunning) {
+                localQueue.store(runnable, std::memory_order_relaxed);
+                localRemaining.store(remaining, std::memory_order_relaxed);
+                localExecuted.store(executedTotal, std::memory_order_relaxed);
+                // peers may still send VMs until the whole group has gone idle
+                if (allVMSCompleted && (!balanceIdle.load(std::memory_order_acquire) ||
+                                        balancePending.load(std::memory_order_acquire))) {
+                    allVMSCompleted = false;
+                } else if (allVMSCompleted) {
+                    std::cout << "Balancer group idle, stopping" << std::endl;
+                }
+            }
+
+            if (!allVMSCompleted && !anyVMRan) { // only paused VMs left (or idle balancer), wait for work
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+
+        if (executionLog) {
+            executionLog->flush();
+        }
+
+        // nothing will serve queued commands anymore
+        std::lock_guard<std::mutex> lock(controlMutex);
+        acceptingControl = false;
+        replyToPendingControl("error: hypervisor stopped\n");
+    }
+
+    // Listens for migrations (TCP) and load reports (UDP) on port and balances with peers
+    bool startBalancer(int port, const std::vector<std::string>& peers) {
+        int tcpSock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int udpSock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (tcpSock < 0 || udpSock < 0) {
+            perror("socket");
+            close(tcpSock);
+            close(udpSock);
+            return false;
+        }
+
+        int opt = 1;
+        setsockopt(tcpSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        struct sockaddr_in serverAddr{};
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = INADDR_ANY; // listen on all interfaces
+        serverAddr.sin_port = htons(port);
+
+        if (bind(tcpSock, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0 ||
+            bind(udpSock, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+            perror("bind");
+            close(tcpSock);
+            close(udpSock);
+            return false;
+        }
+
+        if (listen(tcpSock, 8) < 0) {
+            perror("listen");
+            close(tcpSock);
+            close(udpSock);
+            return false;
+        }
+
+        for (const auto& peer : peers) {
+            if (peer.find(':') == std::string::npos) {
+                std::cerr << "Invalid balancer peer " << peer << ". Expecting IP:PORT" << std::endl;
+                close(tcpSock);
+                close(udpSock);
+                return false;
             }
-            case InstructionType::ADDIU: {
-                oss << "addiu";
-                break;
+        }
+
+        balanceTcpSock = tcpSock;
+        balanceUdpSock = udpSock;
+        balancePort = port;
+        balancePeers = peers;
+        balancerRunning = true;
+        balancerThread = std::thread(&Hypervisor::serveBalancer, this);
+
+        std::cout << "Hypervisor is balancing on port " << port << " with " << peers.size() << " peers" << std::endl;
+        return true;
+    }
+
+    void stopBalancer() {
+        if (!balancerRunning.exchange(false)) {
+            return;
+        }
+        balancerThread.join();
+        close(balanceTcpSock);
+        close(balanceUdpSock);
+    }
+
+    bool startControlServer(const std::string& socketPath) {
+        struct sockaddr_un serverAddr{};
+        serverAddr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(serverAddr.sun_path)) {
+            std::cerr << "Unix socket path too long: " << socketPath << std::endl;
+            return false;
+        }
+        std::strncpy(serverAddr.sun_path, socketPath.c_str(), sizeof(serverAddr.sun_path) - 1);
+
+        int listenSock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenSock < 0) {
+            perror("socket");
+            return false;
+        }
+
+        unlinkSocket(socketPath); // stale socket from a previous run
+        if (bind(listenSock, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+            perror("bind");
+            close(listenSock);
+            return false;
+        }
+
+        if (listen(listenSock, 4) < 0) {
+            perror("listen");
+            close(listenSock);
+            unlinkSocket(socketPath);
+            return false;
+        }
+
+        controlListenSock = listenSock;
+        controlSocketPath = socketPath;
+        controlRunning = true;
+        controlThread = std::thread(&Hypervisor::serveControl, this);
+
+        std::cout << "Hypervisor control socket at " << socketPath << std::endl;
+        return true;
+    }
+
+    void stopControlServer() {
+        if (!controlRunning.exchange(false)) {
+            return;
+        }
+
+        // run() may never have drained the queue (replay, failed listen), so
+        // answer whatever the client threads are still waiting on
+        {
+            std::lock_guard<std::mutex> lock(controlMutex);
+            acceptingControl = false;
+            replyToPendingControl("error: hypervisor stopped\n");
+        }
+
+        // wake the accept thread, then every client thread out of recv
+        shutdown(controlListenSock, SHUT_RDWR);
+        controlThread.join();
+
+        std::list<std::unique_ptr<ControlClient>> clients;
+        {
+            std::lock_guard<std::mutex> lock(controlClientsMutex);
+            for (auto& client : controlClients) {
+                shutdown(client->sock, SHUT_RDWR);
             }
-            case InstructionType::MUL: { // Result in 32-bit integer
-                oss << "mul";
-                break;
+            clients.swap(controlClients);
+        }
+        controlStopped.notify_all();
+        for (auto& client : clients) {
+            client->thread.join();
+            close(client->sock);
+        }
+
+        close(controlListenSock);
+        controlListenSock = -1;
+        unlinkSocket(controlSocketPath);
+    }
+
+private:
+    void serveControl() {
+        while (controlRunning) {
+            int clientSock = accept4(controlListenSock, nullptr, nullptr, SOCK_CLOEXEC);
+            if (clientSock < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break; // listen socket shut down
             }
-            case InstructionType::MULT: {
-                oss << "mult";
-                break;
+
+            std::lock_guard<std::mutex> lock(controlClientsMutex);
+            reapControlClients();
+            auto client = std::make_unique<ControlClient>();
+            client->sock = clientSock;
+            client->thread = std::thread(&Hypervisor::serveControlClient, this, client.get());
+            controlClients.emplace_back(std::move(client));
+        }
+    }
+
+    // Caller holds controlClientsMutex. The socket is closed here rather than by
+    // the client thread so stopControlServer never shuts down a reused descriptor.
+    void reapControlClients() {
+        for (auto it = controlClients.begin(); it != controlClients.end();) {
+            if ((*it)->done) {
+                (*it)->thread.join();
+                close((*it)->sock);
+                it = controlClients.erase(it);
+            } else {
+                ++it;
             }
-            case InstructionType::DIV: {
-                oss << "div";
+        }
+    }
+
+    void serveControlClient(ControlClient* client) {
+        std::string pending;
+        char buffer[512];
+        bool clientOpen = true;
+        while (clientOpen && controlRunning) {
+            ssize_t recvBytes = recv(client->sock, buffer, sizeof(buffer), 0);
+            if (recvBytes <= 0) {
                 break;
             }
+            pending.append(buffer, recvBytes);
 
-            // LOGICAL
-            case InstructionType::AND:
-                oss << "and";
-                break;
-            case InstructionType::ANDI:
-                oss << "andi";
-                break;
-            case InstructionType::OR:
-                oss << "or";
-                break;
-            case InstructionType::ORI:
-                oss << "ori";
-                break;
-            case InstructionType::XOR:
-                oss << "xor";
-                break;
-            case InstructionType::XORI:
-                oss << "xori";
-                break;
-            case InstructionType::SLL:
-                oss << "sll";
-                break;
-            case InstructionType::SRL:
-                oss << "srl";
-                break;
+            size_t lineEnd;
+            while (clientOpen && (lineEnd = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, lineEnd);
+                pending.erase(0, lineEnd + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                if (!line.empty()) {
+                    clientOpen = serveControlLine(client->sock, line);
+                }
+            }
+        }
+        client->done = true;
+    }
 
-            // DATA
-            case InstructionType::LI:
-                oss << "li";
-                break;
+    // Returns false once the client can no longer be written to
+    bool serveControlLine(int clientSock, const std::string& line) {
+        std::istringstream iss(line);
+        std::string command;
+        int intervalMs = 0;
+        iss >> command >> intervalMs;
 
-            // SPECIAL
-            case InstructionType::DUMP_PROCESSOR_STATE:
-                oss << "DUMP_PROCESSOR_STATE";
-                break;
+        // "stats <interval_ms>" keeps streaming until the client disconnects
+        bool streaming = command == "stats" && intervalMs > 0;
+        do {
+            std::string reply = submitControl(line);
+            if (!sendAll(clientSock, reply)) {
+                return false;
+            }
+            if (streaming) {
+                std::unique_lock<std::mutex> lock(controlClientsMutex);
+                controlStopped.wait_for(lock, std::chrono::milliseconds(intervalMs), [this] { return !controlRunning; });
+            }
+        } while (streaming && controlRunning);
+        return true;
+    }
 
-            case InstructionType::MIGRATE:
-                oss << "MIGRATE";
-                break;
+    std::string submitControl(const std::string& line) {
+        auto request = std::make_unique<ControlRequest>();
+        request->command = line;
+        std::future<std::string> reply = request->reply.get_future();
+        {
+            std::lock_guard<std::mutex> lock(controlMutex);
+            if (!acceptingControl) {
+                return "error: hypervisor stopped\n";
+            }
+            controlQueue.emplace_back(std::move(request));
+            controlPending.store(true, std::memory_order_release);
+        }
+        return reply.get();
+    }
 
-            case InstructionType::SNAPSHOT:
-                oss << "SNAPSHOT";
-                break;
+    // Only ever removes a socket, never some other file the path happens to name
+    static void unlinkSocket(const std::string& path) {
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path.c_str());
+        }
+    }
 
-            default:
-                std::cerr << "Invalid MIPS inst being serialized" << std::endl;
+    static bool sendAll(int sock, const std::string& data) {
+        size_t totalSent = 0;
+        while (totalSent < data.size()) {
+            ssize_t sent = send(sock, data.c_str() + totalSent, data.size() - totalSent, MSG_NOSIGNAL);
+            if (sent < 0) {
+                return false;
+            }
+            totalSent += sent;
+        }
+        return true;
+    }
+
+    // Caller holds controlMutex
+    void replyToPendingControl(const std::string& reply) {
+        for (auto& request : controlQueue) {
+            request->reply.set_value(reply);
         }
+        controlQueue.clear();
+        controlPending.store(false, std::memory_order_release);
+    }
 
-        // serialize operands
-        if (inst.instructionType == InstructionType::MIGRATE) {
-            oss << "," << inst.migratePath;
-        } else if (inst.instructionType == InstructionType::SNAPSHOT) {
-            oss << "," << inst.snapshotPath;
+    void processControlRequests() {
+        std::vector<std::unique_ptr<ControlRequest>> requests;
+        {
+            std::lock_guard<std::mutex> lock(controlMutex);
+            requests.swap(controlQueue);
+            controlPending.store(false, std::memory_order_release);
+        }
+
+        for (auto& request : requests) {
+            request->reply.set_value(handleControlCommand(request->command));
+        }
+    }
+
+    // Marks vm i as most recently scheduled and evicts cold VMs above the watermark
+    void touchVM(size_t i) {
+        auto it = residentVMs.find(i);
+        if (it != residentVMs.end()) {
+            residentLRU.splice(residentLRU.end(), residentLRU, it->second.lruPosition);
         } else {
-            for (size_t j = 0; j < inst.operands.size(); j++) {
-                oss << "," << inst.operands[j];
+            size_t bytes = vms[i]->residentBytes();
+            residentLRU.push_back(i);
+            residentVMs[i] = ResidentEntry{std::prev(residentLRU.end()), bytes};
+            residentBytes += bytes;
+        }
+
+        while (residentBytes > residentWatermarkBytes && residentLRU.front() != i) {
+            hibernateVM(residentLRU.front());
+        }
+    }
+
+    // A VM whose state can't be written stays resident but leaves the LRU, so the
+    // eviction loop moves on; it is counted again the next time it is scheduled.
+    void hibernateVM(size_t i) {
+        std::string path = hibernateDir + "/vm_" + std::to_string(i) + ".state";
+        if (!vms[i]->hibernate(path)) {
+            std::cerr << "Couldn't hibernate VM " << vms[i]->getVMID() << ", keeping it resident" << std::endl;
+        }
+        auto it = residentVMs.find(i);
+        if (it != residentVMs.end()) {
+            residentBytes -= it->second.bytes;
+            residentLRU.erase(it->second.lruPosition);
+            residentVMs.erase(it);
+        }
+    }
+
+    // A finished or migrated VM won't run here again: it leaves the LRU, drops its
+    // program and its slot goes to the next VM that joins
+    void retireVM(size_t i) {
+        auto it = residentVMs.find(i);
+        if (it != residentVMs.end()) {
+            residentBytes -= it->second.bytes;
+            residentLRU.erase(it->second.lruPosition);
+            residentVMs.erase(it);
+        }
+        vms[i]->releaseProgram();
+        vms[i]->markRetired();
+        freeSlots.push_back(i);
+    }
+
+    bool wakeVM(size_t i) {
+        if (!vms[i]->wake()) {
+            std::cerr << "Couldn't restore hibernated VM " << vms[i]->getVMID() << std::endl;
+            return false;
+        }
+        touchVM(i);
+        return true;
+    }
+
+    bool wakeVM(VM* vm) {
+        for (size_t i = 0; i < vms.size(); i++) {
+            if (vms[i].get() == vm) {
+                return wakeVM(i);
             }
         }
+        return false;
+    }
 
-        return oss.str();
+    // Migration decided by the hypervisor itself (control socket, balancer)
+    bool migrateVM(VM& vm, const std::string& target) {
+        vm.migrate(target, true);
+        if (!vm.isMigrated()) {
+            return false;
+        }
+        if (executionLog) {
+            executionLog->migrated(vm.getLogIndex());
+        }
+        return true;
     }
 
-    void deserialize(const std::string& data) {
-        std::istringstream iss(data);
-        std::string line;
-        while (std::getline(iss, line)) {
-            if (line.empty() || line[0] == '#') {
+    static constexpr auto BALANCE_REPORT_INTERVAL = std::chrono::milliseconds(250);
+    static constexpr auto BALANCE_REPORT_TIMEOUT = std::chrono::seconds(2);  // older peer reports are ignored
+    static constexpr auto BALANCE_MOVE_COOLDOWN = std::chrono::seconds(1);   // between moves out of this hypervisor
+    static constexpr auto BALANCE_VM_COOLDOWN = std::chrono::seconds(5);     // before a VM that just arrived may move again
+    static constexpr uint64_t BALANCE_QUEUE_MARGIN = 2;                     // queue difference needed to move
+    static constexpr double BALANCE_DRAIN_RATIO = 1.5;                      // and our drain time must be this much worse
+    static constexpr auto BALANCE_IDLE_GRACE = std::chrono::seconds(2);      // everyone idle this long before we stop
+    static constexpr auto BALANCE_RECV_TIMEOUT = std::chrono::seconds(5);    // for an incoming VM to arrive in full
+    static constexpr uint32_t BALANCE_MAX_STATE_BYTES = 256u << 20;          // larger incoming VMs are refused
+
+    void serveBalancer() {
+        auto lastReport = std::chrono::steady_clock::time_point();
+        auto lastMove = std::chrono::steady_clock::time_point();
+        uint64_t movesRequested = 0;
+        auto rateSampledAt = std::chrono::steady_clock::now();
+        uint64_t rateSampledExecuted = 0;
+        double localIps = 0;
+        auto idleSince = std::chrono::steady_clock::time_point();
+
+        while (balancerRunning) {
+            struct pollfd fds[2];
+            fds[0] = {balanceTcpSock, POLLIN, 0};
+            fds[1] = {balanceUdpSock, POLLIN, 0};
+            int ready = poll(fds, 2, 50);
+            if (ready < 0 && errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            if (ready > 0 && (fds[0].revents & POLLIN)) {
+                receiveBalancedMigration();
+            }
+            if (ready > 0 && (fds[1].revents & POLLIN)) {
+                receiveLoadReport();
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastReport < BALANCE_REPORT_INTERVAL) {
                 continue;
             }
 
-            size_t eqPos = line.find('=');
-            if (eqPos == std::string::npos) {
+            uint64_t executed = localExecuted.load(std::memory_order_relaxed);
+            double seconds = std::chrono::duration<double>(now - rateSampledAt).count();
+            localIps = seconds > 0 ? (executed - rateSampledExecuted) / seconds : localIps;
+            rateSampledAt = now;
+            rateSampledExecuted = executed;
+
+            uint64_t queue = localQueue.load(std::memory_order_relaxed);
+            uint64_t remaining = localRemaining.load(std::memory_order_relaxed);
+            {
+                // VMs that arrived but aren't adopted yet are already our load
+                std::lock_guard<std::mutex> lock(balanceMutex);
+                queue += incomingStates.size();
+            }
+            sendLoadReports(queue, remaining, localIps);
+            lastReport = now;
+
+            // peers that don't report aren't running anything they could send us
+            bool idle = queue == 0 && movesFinished.load(std::memory_order_acquire) >= movesRequested;
+            for (const auto& [peer, load] : peerLoads) {
+                if (load.reported && now - load.reportedAt <= BALANCE_REPORT_TIMEOUT && load.queue > 0) {
+                    idle = false;
+                }
+            }
+            if (!idle) {
+                idleSince = std::chrono::steady_clock::time_point();
+            } else if (idleSince == std::chrono::steady_clock::time_point()) {
+                idleSince = now;
+            }
+            balanceIdle.store(idle && now - idleSince >= BALANCE_IDLE_GRACE, std::memory_order_release);
+
+            // one move at a time, and only on reports sent after the last one landed
+            if (movesFinished.load(std::memory_order_acquire) < movesRequested || now - lastMove < BALANCE_MOVE_COOLDOWN) {
                 continue;
             }
+            auto settledAt = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(lastMoveFinishedAt.load(std::memory_order_relaxed)));
+            std::string target = pickBalanceTarget(queue, remaining, localIps, now, settledAt + BALANCE_REPORT_INTERVAL);
+            if (!target.empty()) {
+                std::lock_guard<std::mutex> lock(balanceMutex);
+                pendingMoveTarget = target;
+                balancePending.store(true, std::memory_order_release);
+                lastMove = now;
+                movesRequested++;
+            }
+        }
+    }
 
-            std::string key = line.substr(0, eqPos);
-            std::string value = line.substr(eqPos + 1);
+    // Least loaded fresh peer worth moving a VM to, or "" to stay put
+    std::string pickBalanceTarget(uint64_t queue, uint64_t remaining, double localIps,
+                                  std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point reportedAfter) {
+        std::string best;
+        uint64_t bestQueue = queue;
+        for (const auto& [peer, load] : peerLoads) {
+            if (!load.reported || now - load.reportedAt > BALANCE_REPORT_TIMEOUT || load.reportedAt < reportedAfter) {
+                continue;
+            }
+            if (load.queue + BALANCE_QUEUE_MARGIN > queue || load.queue >= bestQueue) {
+                continue;
+            }
+            // time to drain the current work; an idle peer drains instantly
+            double localDrain = localIps > 0 ? remaining / localIps : remaining;
+            double peerDrain = load.ips > 0 ? load.remaining / load.ips : (load.queue == 0 ? 0 : load.remaining);
+            if (localDrain < peerDrain * BALANCE_DRAIN_RATIO) {
+                continue;
+            }
+            best = peer;
+            bestQueue = load.queue;
+        }
+        return best;
+    }
 
-            std::string remainingData = ""; // cpu specific data
+    void sendLoadReports(uint64_t queue, uint64_t remaining, double ips) {
+        std::ostringstream oss;
+        oss << "port=" << balancePort << "\nqueue=" << queue << "\nremaining=" << remaining << "\nips=" << ips << "\n";
+        std::string report = oss.str();
 
-            if (key == "curr_inst_index") {
-                currentInstructionIndex = std::stoi(value);
-            } else if (key == "slice_instructions") {
-                config.vm_exec_slice_in_instructions = std::stoi(value);
-            } else if (key == "instruction") {
-                Instruction inst = stringToInst(value);
-                instructions.emplace_back(inst);
-            } else {
-                remainingData = line + "\n";
+        for (const auto& peer : balancePeers) {
+            size_t colonPos = peer.find(':');
+            struct sockaddr_in peerAddr{};
+            peerAddr.sin_family = AF_INET;
+            peerAddr.sin_port = htons(std::stoi(peer.substr(colonPos + 1)));
+            if (inet_pton(AF_INET, peer.substr(0, colonPos).c_str(), &peerAddr.sin_addr) <= 0) {
+                continue;
             }
+            sendto(balanceUdpSock, report.c_str(), report.size(), 0, (struct sockaddr*)&peerAddr, sizeof(peerAddr));
+        }
+    }
 
-            cpu->deserialize(remainingData);
+    void receiveLoadReport() {
+        char buffer[256];
+        struct sockaddr_in fromAddr{};
+        socklen_t addrLen = sizeof(fromAddr);
+        ssize_t received = recvfrom(balanceUdpSock, buffer, sizeof(buffer) - 1, 0, (struct sockaddr*)&fromAddr, &addrLen);
+        if (received <= 0) {
+            return;
+        }
+        buffer[received] = '\0';
+
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &fromAddr.sin_addr, ip, sizeof(ip));
+
+        PeerLoad load;
+        int port = 0;
+        std::istringstream iss(buffer);
+        std::string line;
+        try {
+            while (std::getline(iss, line)) {
+                size_t equalPos = line.find('=');
+                std::string key = line.substr(0, equalPos);
+                std::string value = line.substr(equalPos + 1);
+                if (key == "port") {
+                    port = std::stoi(value);
+                } else if (key == "queue") {
+                    load.queue = std::stoull(value);
+                } else if (key == "remaining") {
+                    load.remaining = std::stoull(value);
+                } else if (key == "ips") {
+                    load.ips = std::stod(value);
+                }
+            }
+        } catch (std::exception& e) {
+            std::cerr << "Malformed load report from " << ip << std::endl;
+            return;
+        }
+
+        std::string peer = std::string(ip) + ":" + std::to_string(port);
+        if (std::find(balancePeers.begin(), balancePeers.end(), peer) == balancePeers.end()) {
+            return; // not one of ours
+        }
+        load.reportedAt = std::chrono::steady_clock::now();
+        load.reported = true;
+        peerLoads[peer] = load;
+    }
+
+    void receiveBalancedMigration() {
+        int clientSock = accept(balanceTcpSock, nullptr, nullptr);
+        if (clientSock < 0) {
+            return;
+        }
+
+        // a stalled sender mustn't hold up load reports and moves
+        struct timeval timeout{};
+        timeout.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(BALANCE_RECV_TIMEOUT).count();
+        setsockopt(clientSock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        uint32_t dataSizeNet;
+        if (recv(clientSock, &dataSizeNet, sizeof(dataSizeNet), MSG_WAITALL) != sizeof(dataSizeNet)) {
+            std::cerr << "Failed to receive data size." << std::endl;
+            close(clientSock);
+            return;
+        }
+
+        uint32_t dataSize = ntohl(dataSizeNet);
+        if (dataSize == 0 || dataSize > BALANCE_MAX_STATE_BYTES) {
+            std::cerr << "Refusing incoming VM of " << dataSize << " bytes" << std::endl;
+            close(clientSock);
+            return;
+        }
+        std::string serializedData(dataSize, '\0');
+        ssize_t received = recv(clientSock, serializedData.data(), dataSize, MSG_WAITALL);
+        close(clientSock);
+        if (received != static_cast<ssize_t>(dataSize)) {
+            std::cerr << "Incomplete data received" << std::endl;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(balanceMutex);
+        incomingStates.emplace_back(std::move(serializedData));
+        balancePending.store(true, std::memory_order_release);
+    }
+
+    // Scheduler side: adopt VMs that arrived and carry out a move the balancer picked
+    void processBalanceRequests() {
+        std::vector<std::string> arrived;
+        std::string target;
+        {
+            std::lock_guard<std::mutex> lock(balanceMutex);
+            arrived.swap(incomingStates);
+            target.swap(pendingMoveTarget);
+            balancePending.store(false, std::memory_order_release);
+        }
+
+        for (const auto& state : arrived) {
+            adoptMigratedVM(state);
+        }
+
+        if (target.empty()) {
+            return;
+        }
+        moveOneVM(target);
+        lastMoveFinishedAt.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        movesFinished.fetch_add(1, std::memory_order_release);
+    }
+
+    void moveOneVM(const std::string& target) {
+        // move the resident VM with the most work left that hasn't just arrived
+        auto now = std::chrono::steady_clock::now();
+        VM* candidate = nullptr;
+        for (auto& vm : vms) {
+            if (vm->isHibernated() || vm->isPaused() || vm->isMigrated() || vm->isFinished() ||
+                now - vm->getArrivedAt() < BALANCE_VM_COOLDOWN) {
+                continue;
+            }
+            if (candidate == nullptr || vm->remainingInstructions() > candidate->remainingInstructions()) {
+                candidate = vm.get();
+            }
+        }
+        if (candidate == nullptr) {
+            return;
+        }
+
+        std::cout << "Balancer moving VM " << candidate->getVMID() << " to " << target << std::endl;
+        if (!migrateVM(*candidate, target)) {
+            std::cerr << "Balancer couldn't move VM " << candidate->getVMID() << " to " << target << std::endl;
+        }
+    }
+
+    VM* findVM(int vmID) {
+        for (auto& vm : vms) {
+            if (vm->getVMID() == vmID) {
+                return vm.get();
+            }
         }
+        return nullptr;
     }
 
-    Instruction stringToInst(const std::string& instStr) const {
-        Instruction inst;
-        std::istringstream iss(instStr);
-        std::string token;
+    // Runs on the scheduler thread between slices
+    std::string handleControlCommand(const std::string& line) {
+        std::istringstream iss(line);
+        std::string command;
+        iss >> command;
 
-        if (!std::getline(iss, token, ',')) {
-            inst.instructionType = InstructionType::INVALID;
-            return inst;
+        if (command == "list" || command == "stats") {
+            std::ostringstream oss;
+            for (const auto& vm : vms) {
+                oss << (command == "list" ? vm->statusLine() : vm->statsLine()) << "\n";
+            }
+            oss << "ok\n";
+            return oss.str();
         }
 
-        inst.instructionType = getInstructionType(token);
+        if (command == "help") {
+            return "list | stats [interval_ms] | pause <vm> | resume <vm> | snapshot <vm> <path>"
+                   " | migrate <vm> <ip:port|unix:path> | slice <vm> <instructions> | checkpoint <dir> | profile"
+                   " | drop <snapshot>\nok\n";
+        }
 
-        while (std::getline(iss, token, ',')) {
-            if (inst.instructionType == InstructionType::MIGRATE) {
-                inst.migratePath = token;
-                break;
-            } else if (inst.instructionType == InstructionType::SNAPSHOT) {
-                inst.snapshotPath = token;
-                break;
-            } else {
-                try {
-                    inst.operands.emplace_back(std::stoi(token));
-                } catch (const std::exception& e) {
-                    std::cerr << "Invalid operand in inst" << instStr << std::endl;
-                }
+        if (command == "drop") {
+            std::string path;
+            if (!(iss >> path)) {
+                return "error: drop needs a snapshot path\n";
             }
+            if (!snapshotStore) {
+                return "error: no snapshot store (start with -k <dir>)\n";
+            }
+            return snapshotStore->remove(path) ? "ok\n" : "error: " + path + " isn't a snapshot in the store\n";
         }
-        return inst;
-    }
 
-    void migrate(const std::string& target) {
-        std::string targetStr = target;
+        if (command == "profile") {
+            if (!profiler) {
+                return "error: profiling is off (start with -S <interval>)\n";
+            }
+            return profiler->report() + "ok\n";
+        }
 
-        if (!targetStr.empty() && targetStr.front() == '[' && targetStr.back() == ']') {
-            targetStr = targetStr.substr(1, targetStr.size() - 2); // stripping brackets from ip:port
+        if (command == "checkpoint") {
+            std::string dir;
+            if (!(iss >> dir)) {
+                return "error: checkpoint needs a directory\n";
+            }
+            return checkpoint(dir) ? "ok\n" : "error: checkpoint to " + dir + " failed\n";
         }
 
-        std::cout << "Migration target: " << target << std::endl;
+        int vmID;
+        if (!(iss >> vmID)) {
+            return "error: unknown command or missing vm id: " + line + "\n";
+        }
+        VM* vm = findVM(vmID);
+        if (vm == nullptr) {
+            return "error: no vm " + std::to_string(vmID) + "\n";
+        }
 
-        size_t colonPos = targetStr.find(':');
-        if (colonPos == std::string::npos) {
-            std::cerr << "Invalid migration format. Expecting IP:PORT" << std::endl;
-            return;
+        if ((command == "snapshot" || command == "migrate") && vm->isHibernated()) {
+            if (!wakeVM(vm)) {
+                return "error: couldn't restore hibernated vm " + std::to_string(vmID) + "\n";
+            }
         }
 
-        // IP and Port
-        std::string ip = targetStr.substr(0, colonPos);
-        int port = std::stoi(targetStr.substr(colonPos + 1)); // TODO - add support for brackets
+        if (command == "pause") {
+            vm->setPaused(true);
+        } else if (command == "resume") {
+            vm->setPaused(false);
+        } else if (command == "snapshot") {
+            std::string path;
+            if (!(iss >> path)) {
+                return "error: snapshot needs a path\n";
+            }
+            if (!vm->snapshotAtBoundary(path)) {
+                return "error: couldn't write snapshot " + path + "\n";
+            }
+        } else if (command == "migrate") {
+            std::string target;
+            if (!(iss >> target)) {
+                return "error: migrate needs a target\n";
+            }
+            if (vm->isMigrated() || vm->isFinished()) {
+                return "error: vm " + std::to_string(vmID) + " is " + vm->stateName() + "\n";
+            }
+            if (!migrateVM(*vm, target)) {
+                return "error: migration to " + target + " failed\n";
+            }
+        } else if (command == "slice") {
+            int sliceSize = 0;
+            if (!(iss >> sliceSize) || sliceSize <= 0) {
+                return "error: slice needs a positive instruction count\n";
+            }
+            vm->setSliceSize(sliceSize);
+        } else {
+            return "error: unknown command: " + command + "\n";
+        }
+        return "ok\n";
+    }
 
-        // Serialize VM
-        std::string serializedState = serialize();
-        uint32_t dataSize = htonl(static_cast<uint32_t>(serializedState.size()));
+public:
+    // Writes every VM into dir plus a manifest listing them. Called between scheduling
+    // rounds, so all VMs are stopped at a slice boundary while the states are written.
+    bool checkpoint(const std::string& dir) {
+        auto start = std::chrono::steady_clock::now();
 
-        // Create socket
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            perror("socket");
-            return;
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec) {
+            std::cerr << "Couldn't create checkpoint directory " << dir << ": " << ec.message() << std::endl;
+            return false;
         }
 
-        // Server address
-        struct sockaddr_in serverAddr;
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(port);
-        if (inet_pton(AF_INET, ip.c_str(), &serverAddr.sin_addr) <= 0) {
-            std::cerr << "Invalid IP addr format: " << ip << std::endl;
-            close(sock);
-            return;
+        // a crash from here on must not leave an old manifest listing new states
+        std::string manifestPath = dir + "/checkpoint.manifest";
+        std::filesystem::remove(manifestPath, ec);
+
+        std::vector<size_t> included; // VMs that migrated away belong to another hypervisor now
+        for (size_t i = 0; i < vms.size(); i++) {
+            if (!vms[i]->isMigrated()) {
+                included.push_back(i);
+            }
         }
 
-        // connect to target hypervisor
-        if (connect(sock, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-            perror("connect");
-            close(sock);
-            return;
+        // Each distinct program is written once as program_<hash> and the state files
+        // name it, so a fleet sharing a program shares it again after restore.
+        // A hibernated VM gets the program its wake would load; a released one has none.
+        std::vector<SharedProgram> programs;
+        std::unordered_map<const std::vector<Instruction>*, size_t> programIndex;
+        std::vector<size_t> vmProgram(included.size(), SIZE_MAX);
+        for (size_t n = 0; n < included.size(); n++) {
+            VM& vm = *vms[included[n]];
+            SharedProgram program = vm.isHibernated() ? programCache.load(vm.getConfig().vm_binary) : vm.getProgram();
+            if (!program) {
+                if (vm.isHibernated()) {
+                    std::cerr << "Failed to load program " << vm.getConfig().vm_binary << std::endl;
+                    return false;
+                }
+                continue;
+            }
+            auto inserted = programIndex.emplace(program.get(), programs.size());
+            if (inserted.second) {
+                programs.push_back(std::move(program));
+            }
+            vmProgram[n] = inserted.first->second;
         }
 
-        // send data size
-        if (send(sock, &dataSize, sizeof(dataSize), 0) != sizeof(dataSize)) {
-            perror("send data size");
-            close(sock);
-            return;
+        std::vector<std::string> programFiles(programs.size());
+        std::atomic<bool> allWritten{true};
+        parallelFor(programs.size(), [&](size_t n) {
+            std::string image = VM::programImage(*programs[n]);
+            programFiles[n] = "program_" + contentHash(image);
+            if (!installFile(dir + "/" + programFiles[n], image)) {
+                allWritten = false;
+            }
+        });
+        if (!allWritten) {
+            return false;
         }
 
-        // send serialized data
-        size_t totalSent = 0;
-        while (totalSent < serializedState.size()) {
-            ssize_t sent = send(sock, serializedState.c_str() + totalSent, serializedState.size() - totalSent, 0);
-            if (sent < 0) {
-                perror("send data");
-                close(sock);
-                return;
+        const std::string noProgram;
+        parallelFor(included.size(), [&](size_t n) {
+            std::string path = dir + "/vm_" + std::to_string(n) + ".state";
+            const std::string& programFile = vmProgram[n] == SIZE_MAX ? noProgram : programFiles[vmProgram[n]];
+            if (!vms[included[n]]->saveState(path, &programFile)) {
+                allWritten = false;
             }
-            totalSent += sent;
+        });
+        if (!allWritten) {
+            return false;
         }
 
-        std::cout << "VM " << cpu->VMID << " migrated to " << ip << ":" << port << std::endl;
-        close(sock);
-        migrated = true;
+        // manifest last and atomically, so a directory without one is an incomplete checkpoint
+        std::ostringstream manifest;
+        manifest << "vms=" << included.size() << "\n";
+        for (size_t n = 0; n < included.size(); n++) {
+            manifest << "vm=vm_" << n << ".state\n";
+        }
+        if (!installFile(manifestPath, manifest.str())) {
+            return false;
+        }
+
+        auto pauseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Checkpoint of " << included.size() << " VMs (" << programs.size() << " programs) written to " << dir
+                  << " (pause " << pauseMs << " ms)" << std::endl;
+        return true;
     }
 
-    bool run(int contextSwitch) {
-        for (int i = 0; i < contextSwitch && currentInstructionIndex < instructions.size(); i++) {
-            if (instructions.at(currentInstructionIndex).instructionType == InstructionType::SNAPSHOT) {
-                snapshot(instructions.at(currentInstructionIndex).snapshotPath);
-            } else if (instructions.at(currentInstructionIndex).instructionType == InstructionType::MIGRATE) {
-                migrate(instructions.at(currentInstructionIndex).migratePath);
-                migrated = true;
+    // Rebuilds the VMs listed in a checkpoint manifest in parallel
+    bool restoreCheckpoint(const std::string& dir) {
+        auto start = std::chrono::steady_clock::now();
+
+        std::ifstream manifest(dir + "/checkpoint.manifest");
+        if (!manifest.is_open()) {
+            std::cerr << "Failed to open checkpoint manifest in " << dir << std::endl;
+            return false;
+        }
+
+        std::vector<std::string> stateFiles;
+        long long expectedVMs = -1;
+        std::string line;
+        while (std::getline(manifest, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            size_t equalPos = line.find('=');
+            std::string key = line.substr(0, equalPos);
+            std::string value = line.substr(equalPos + 1);
+            if (key == "vm") {
+                stateFiles.emplace_back(dir + "/" + value);
+            } else if (key == "vms") {
+                expectedVMs = std::stoll(value);
             } else {
-                cpu->execute(instructions.at(currentInstructionIndex));
+                std::cerr << "Unknown manifest key: " << key << std::endl;
             }
-            currentInstructionIndex++;
         }
-        return !migrated && currentInstructionIndex < instructions.size(); // end process after migration on sender
-//        return currentInstructionIndex < instructions.size(); // continue process after migration
-    }
+        if (expectedVMs != static_cast<long long>(stateFiles.size())) {
+            std::cerr << "Checkpoint manifest in " << dir << " lists " << stateFiles.size() << " VMs, expected "
+                      << expectedVMs << std::endl;
+            return false;
+        }
 
-    bool isMigrated() const {
-        return migrated;
-    }
+        std::vector<std::unique_ptr<VM>> restored(stateFiles.size());
+        std::atomic<bool> allRestored{true};
+        parallelFor(stateFiles.size(), [&](size_t n) {
+            auto vm = std::make_unique<VM>(Config(), std::make_unique<CPU>(0));
+            vm->attachProgramCache(&programCache); // VMs sharing a program file share the program
+            if (vm->loadState(stateFiles[n])) {
+                restored[n] = std::move(vm);
+            } else {
+                allRestored = false;
+            }
+        });
+        if (!allRestored) {
+            return false;
+        }
 
-    int getCurrInstIndex() const {
-        return currentInstructionIndex;
-    }
+        for (auto& vm : restored) {
+            addVM(std::move(vm));
+        }
 
-    Config getConfig() {
-        return this->config;
+        auto restoreMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Restored " << stateFiles.size() << " VMs from checkpoint " << dir
+                  << " (" << restoreMs << " ms)" << std::endl;
+        return true;
     }
 
-    std::unique_ptr<CPU> releaseCPU() {
-        return std::move(cpu);
-    }
-};
+    // Re-runs a recorded fleet: VMs are rebuilt from their recorded states and
+    // given exactly the recorded slices in the recorded order.
+    bool replay(const std::string& path) {
+        ExecutionLog log;
+        if (!log.openForReplay(path)) {
+            return false;
+        }
 
-class Hypervisor {
-private:
-    std::vector<std::unique_ptr<VM>> vms;
-public:
-    Hypervisor() = default;
-    void createVM(const Config& config) {
-       std::unique_ptr<VM> vm = std::make_unique<VM>(config);
-       vms.emplace_back(std::move(vm));
-    }
-    void createVM(const Config& config, std::unique_ptr<CPU> cpu) {
-        std::unique_ptr<VM> vm = std::make_unique<VM>(config, std::move(cpu));
-        vms.emplace_back(std::move(vm));
-    }
-    void createVM(const Config& config, std::unique_ptr<CPU> cpu, int current_instruction_index) {
-        std::unique_ptr<VM> vm = std::make_unique<VM>(config, std::move(cpu), current_instruction_index);
-        vms.emplace_back(std::move(vm));
-    }
-    void run() {
-        bool allVMSCompleted = false;
-        while (!allVMSCompleted) {
-            allVMSCompleted = true;
-            for (int i = 0; i < vms.size(); i++) {
-                bool vmHasMoreInstructions = vms.at(i)->run(vms.at(i)->getConfig().vm_exec_slice_in_instructions);
-                if (vmHasMoreInstructions) {
-                    allVMSCompleted = false;
+        ExecutionLog::Record record;
+        std::vector<ExecutionLog::GuestEvent> expectedEvents;
+        uint64_t slices = 0;
+        uint64_t divergences = 0;
+        uint64_t restored = 0;
+        while (log.next(record)) {
+            if (record.type == ExecutionLog::RESTORE || record.type == ExecutionLog::RESTORE_SHARED) {
+                // a new slot, or the slot of a VM that was retired when this was recorded
+                bool reused = record.vm < vms.size() && (vms[record.vm]->isFinished() || vms[record.vm]->isMigrated());
+                if (record.vm != vms.size() && !reused) {
+                    std::cerr << "Replay log restores VM " << record.vm << " out of order" << std::endl;
+                    return false;
+                }
+                auto vm = std::make_unique<VM>(Config(), std::make_unique<CPU>(0));
+                vm->deserialize(record.state);
+                if (record.program) {
+                    vm->setProgram(record.program);
+                }
+                vm->attachExecutionLog(&log, record.vm);
+                vm->verify();
+                attachProfiler(*vm, record.vm);
+                attachTranslation(*vm);
+                if (reused) {
+                    vms[record.vm]->discardHibernation();
+                    vms[record.vm] = std::move(vm);
+                } else {
+                    vms.emplace_back(std::move(vm));
+                }
+                restored++;
+                continue;
+            }
+
+            if (record.vm >= vms.size()) {
+                std::cerr << "Replay log references unknown VM " << record.vm << std::endl;
+                return false;
+            }
+            size_t i = record.vm;
+
+            if (record.type == ExecutionLog::GUEST_EVENT) {
+                expectedEvents.push_back({record.vm, record.value, record.extra});
+            } else if (record.type == ExecutionLog::MIGRATED) {
+                vms[i]->markMigrated();
+            } else if (record.type == ExecutionLog::SLICE) {
+                if (vms[i]->isHibernated() && !wakeVM(i)) {
+                    return false;
+                }
+                if (vms[i]->run(static_cast<int>(record.value))) {
                     std::cout << "(VM: " << i + 1 << " running)" << std::endl;
                 }
+                slices++;
+
+                if (log.takeObservedEvents() != expectedEvents) {
+                    std::cerr << "Replay diverged in VM " << vms[i]->getVMID() << " at slice " << slices << std::endl;
+                    divergences++;
+                }
+                expectedEvents.clear();
             }
         }
+
+        std::cout << "Replay finished: " << restored << " VMs, " << slices << " slices, "
+                  << divergences << " divergences" << std::endl;
+        return divergences == 0;
     }
 
     void listenMigration(int port) {
@@ -846,28 +4275,170 @@ public:
             return;
         }
 
-        // Deserialize VM
-        std::unique_ptr<CPU> cpu = std::make_unique<CPU>(0); // temp VMID
-        std::unique_ptr<VM> migratedVM = std::make_unique<VM>(Config(), std::move(cpu));
-        migratedVM->deserialize(serializedData);
-        Config config = migratedVM->getConfig();
-        migratedVM->changeVMID(config.vmID);
+        adoptMigratedVM(serializedData);
 
-        vms.emplace_back(std::move(migratedVM));
+        close(clientSock);
+        close(listenSock);
+
+        run();
+    }
 
-        std::cout << "Migrated VM " << config.vmID << " has been received and added to hypervisor" << std::endl;
+    void listenMigrationLocal(const std::string& socketPath) {
+        struct sockaddr_un serverAddr{};
+        serverAddr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(serverAddr.sun_path)) {
+            std::cerr << "Unix socket path too long: " << socketPath << std::endl;
+            return;
+        }
+        std::strncpy(serverAddr.sun_path, socketPath.c_str(), sizeof(serverAddr.sun_path) - 1);
 
-        close(clientSock);
+        int listenSock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenSock < 0) {
+            perror("socket");
+            return;
+        }
+
+        unlinkSocket(socketPath); // stale socket from a previous run
+        if (bind(listenSock, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+            perror("bind");
+            close(listenSock);
+            return;
+        }
+
+        if (listen(listenSock, 1) < 0) {
+            perror("listen");
+            close(listenSock);
+            unlinkSocket(socketPath);
+            return;
+        }
+
+        std::cout << "Hypervisor is listening on unix:" << socketPath << " for migration" << std::endl;
+
+        int clientSock = accept(listenSock, nullptr, nullptr);
         close(listenSock);
+        unlinkSocket(socketPath);
+        if (clientSock < 0) {
+            perror("accept");
+            return;
+        }
+
+        std::cout << "Accepted local migration connection..." << std::endl;
+
+        // receive the state and program sizes and the memfd holding both
+        uint32_t dataSize[2] = {};
+        struct iovec iov;
+        iov.iov_base = dataSize;
+        iov.iov_len = sizeof(dataSize);
+
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        struct msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t received = recvmsg(clientSock, &msg, MSG_CMSG_CLOEXEC);
+        close(clientSock);
+        if (received != sizeof(dataSize)) {
+            std::cerr << "Failed to receive data size." << std::endl;
+            return;
+        }
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            std::cerr << "No state descriptor received" << std::endl;
+            return;
+        }
+        int memFd;
+        std::memcpy(&memFd, CMSG_DATA(cmsg), sizeof(int));
+
+        // an unsealed memfd could be truncated by the sender while we read it (SIGBUS)
+        constexpr int requiredSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+        int seals = fcntl(memFd, F_GET_SEALS);
+        if (seals < 0 || (seals & requiredSeals) != requiredSeals) {
+            std::cerr << "Refusing state descriptor that isn't sealed" << std::endl;
+            close(memFd);
+            return;
+        }
+
+        size_t stateSize = dataSize[0];
+        size_t mappedSize = stateSize + dataSize[1];
+        struct stat st;
+        if (fstat(memFd, &st) < 0 || static_cast<size_t>(st.st_size) < mappedSize || stateSize == 0) {
+            std::cerr << "Incomplete data received" << std::endl;
+            close(memFd);
+            return;
+        }
+
+        void* region = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, memFd, 0);
+        close(memFd);
+        if (region == MAP_FAILED) {
+            perror("mmap");
+            return;
+        }
+
+        std::string_view data(static_cast<const char*>(region), mappedSize);
+        SharedProgram program;
+        if (dataSize[1] > 0) {
+            std::vector<Instruction> instructions;
+            size_t pos = stateSize;
+            if (!decodeProgram(data, pos, instructions) || pos != mappedSize) {
+                std::cerr << "Malformed program received" << std::endl;
+                munmap(region, mappedSize);
+                return;
+            }
+            program = std::make_shared<const std::vector<Instruction>>(std::move(instructions));
+        }
+        adoptMigratedVM(data.substr(0, stateSize), program);
+        munmap(region, mappedSize);
 
         run();
     }
+
+    // program is set when it arrived apart from the text state (same-host migration)
+    void adoptMigratedVM(std::string_view serializedData, SharedProgram program = nullptr) {
+        std::unique_ptr<CPU> cpu = std::make_unique<CPU>(0); // temp VMID
+        std::unique_ptr<VM> migratedVM = std::make_unique<VM>(Config(), std::move(cpu));
+        migratedVM->deserialize(serializedData);
+        if (program) {
+            migratedVM->setProgram(std::move(program));
+        }
+        migratedVM->markArrived();
+
+        // keep the sender's id unless a VM here already has it, else take a fresh one
+        int sentVMID = migratedVM->getVMID();
+        if (findVM(sentVMID) != nullptr) {
+            migratedVM->changeVMID(highestVMID + 1);
+        }
+        int vmID = migratedVM->getVMID();
+
+        addVM(std::move(migratedVM));
+
+        if (vmID != sentVMID) {
+            std::cout << "Migrated VM " << sentVMID << " has been received and added to hypervisor as VM " << vmID << std::endl;
+        } else {
+            std::cout << "Migrated VM " << vmID << " has been received and added to hypervisor" << std::endl;
+        }
+    }
 };
 
 int main(int argc, char* argv[]) {
     std::vector<VMFileConfig> vmFileConfigsVector;
     bool listeningMode = false;
     int port = 0; // Default port
+    std::string localSocketPath; // unix:/path listen target for same-host migration
+    std::string controlSocketPath;
+    size_t hibernateWatermarkKB = 0;
+    std::string hibernateDir = "vmm_hibernate";
+    std::string checkpointDir; // restore the fleet from this checkpoint
+    std::string recordPath;
+    std::string replayPath;
+    uint64_t profileInterval = 0;
+    std::string profileFoldedPath = "vmm_profile.folded";
+    std::string aotCacheDir;
+    std::string snapshotStoreDir;
+    std::string fleetManifestPath;
+    std::vector<std::string> balancePeers;
 
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
@@ -885,8 +4456,43 @@ int main(int argc, char* argv[]) {
             }
             vmFileConfigsVector.emplace_back(std::move(vmFileConfig));
         } else if (arg == "-p" && i + 1 < argc) {
-            port = std::stoi(argv[++i]);
+            std::string listenTarget = argv[++i];
+            if (listenTarget.rfind("unix:", 0) == 0) {
+                localSocketPath = listenTarget.substr(5);
+            } else {
+                port = std::stoi(listenTarget);
+            }
             listeningMode = true;
+        } else if (arg == "-c" && i + 1 < argc) { // control socket
+            controlSocketPath = argv[++i];
+        } else if (arg == "-H" && i + 1 < argc) { // resident memory watermark in KB
+            hibernateWatermarkKB = std::stoul(argv[++i]);
+        } else if (arg == "-d" && i + 1 < argc) { // hibernation directory
+            hibernateDir = argv[++i];
+        } else if (arg == "-r" && i + 1 < argc) { // checkpoint to restore
+            checkpointDir = argv[++i];
+        } else if (arg == "-R" && i + 1 < argc) { // record execution log
+            recordPath = argv[++i];
+        } else if (arg == "-P" && i + 1 < argc) { // replay execution log
+            replayPath = argv[++i];
+        } else if (arg == "-S" && i + 1 < argc) { // profile: sample every N instructions
+            profileInterval = std::stoull(argv[++i]);
+        } else if (arg == "-F" && i + 1 < argc) { // profile: folded stack output
+            profileFoldedPath = argv[++i];
+        } else if (arg == "-a" && i + 1 < argc) { // AOT translation cache
+            aotCacheDir = argv[++i];
+        } else if (arg == "-k" && i + 1 < argc) { // content-addressed snapshot store
+            snapshotStoreDir = argv[++i];
+        } else if (arg == "-m" && i + 1 < argc) { // fleet manifest
+            fleetManifestPath = argv[++i];
+        } else if (arg == "-b" && i + 1 < argc) { // balance with these hypervisors (ip:port,...)
+            std::istringstream peers(argv[++i]);
+            std::string peer;
+            while (std::getline(peers, peer, ',')) {
+                if (!peer.empty()) {
+                    balancePeers.push_back(peer);
+                }
+            }
         } else {
             std::cerr << "No arg given after flag" << arg << std::endl;
             return 1; // TODO - check if valid behavior
@@ -895,37 +4501,67 @@ int main(int argc, char* argv[]) {
 
     Hypervisor hypervisor;
 
-    if (listeningMode) {
+    if (!controlSocketPath.empty() && !hypervisor.startControlServer(controlSocketPath)) {
+        std::cerr << "Couldn't start control socket: " << controlSocketPath << std::endl;
+        return 1;
+    }
+
+    if (hibernateWatermarkKB > 0 && !hypervisor.enableHibernation(hibernateWatermarkKB * 1024, hibernateDir)) {
+        return 1;
+    }
+
+    if (profileInterval > 0) {
+        hypervisor.startProfiling(profileInterval, profileFoldedPath);
+    }
+
+    if (!aotCacheDir.empty() && !hypervisor.enableTranslationCache(aotCacheDir)) {
+        return 1;
+    }
+
+    if (!snapshotStoreDir.empty() && !hypervisor.enableSnapshotStore(snapshotStoreDir)) {
+        return 1;
+    }
+
+    if (!replayPath.empty()) {
+        bool replayed = hypervisor.replay(replayPath);
+        hypervisor.finishProfiling();
+        return replayed ? 0 : 1;
+    }
+
+    if (!recordPath.empty() && !hypervisor.startRecording(recordPath)) {
+        return 1;
+    }
+
+    if (!balancePeers.empty()) { // -p becomes the balancer's port and the hypervisor keeps serving
+        if (!listeningMode || !localSocketPath.empty()) {
+            std::cerr << "-b needs a TCP port given with -p" << std::endl;
+            return 1;
+        }
+        if (!hypervisor.startBalancer(port, balancePeers)) {
+            return 1;
+        }
+        listeningMode = false;
+    }
+
+    if (listeningMode && !localSocketPath.empty()) {
+        hypervisor.listenMigrationLocal(localSocketPath);
+    } else if (listeningMode) {
         hypervisor.listenMigration(port);
     } else {
-        int vmID = 0;
-        for (const auto& vmConfig : vmFileConfigsVector) {
-            vmID++;
-            Config config;
-            config.vmID = vmID;
-            if (!parseConfigFile(vmConfig.vmFile, config)) {
-                std::cerr << "Error parsing config assembly file" << std::endl;
-                return 1;
-            }
-            if (!vmConfig.snapshotFile.empty()) {
-                std::array<int, 32> registers{};
-                uint32_t pc;
-                std::string binaryFile;
-                parseSnapshotFile(vmConfig.snapshotFile, registers, pc, binaryFile);
-                std::unique_ptr<CPU> cpu = std::make_unique<CPU>(registers, config.vmID);
-                pc++;
-                cpu->pc = pc;
-                if (config.vm_binary == binaryFile) { // Same assembly file -> continue from snapshot point
-                    hypervisor.createVM(config, std::move(cpu), static_cast<int>(pc));
-                } else { // otherwise just use registers
-                    hypervisor.createVM(config, std::move(cpu));
-                }
-            } else {
-                hypervisor.createVM(config);
-            }
+        if (!checkpointDir.empty() && !hypervisor.restoreCheckpoint(checkpointDir)) {
+            std::cerr << "Error restoring checkpoint " << checkpointDir << std::endl;
+            return 1;
+        }
+
+        if (!fleetManifestPath.empty() && !parseFleetManifest(fleetManifestPath, vmFileConfigsVector)) {
+            return 1;
+        }
+        if (!hypervisor.startFleet(vmFileConfigsVector, !fleetManifestPath.empty())) {
+            return 1;
         }
         hypervisor.run();
     }
 
-    return 0;
+    hypervisor.finishProfiling();
+    return hypervisor.getLostVMCount() > 0 ? 1 : 0;
 }
\ No newline at end of file